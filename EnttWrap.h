@@ -1,5 +1,45 @@
 #pragma once
 #include "entt/entt.hpp"
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <typeinfo>
+#include <utility>
+
+#if defined(_MSC_VER)
+#include <xmmintrin.h>
+#define ENTTWRAP_PREFETCH(addr) _mm_prefetch(reinterpret_cast<const char*>(addr), _MM_HINT_T0)
+#else
+#define ENTTWRAP_PREFETCH(addr) __builtin_prefetch(addr)
+#endif
+
+//定义 ENTTWRAP_PROFILE 时启用 ENTTWRAP_ZONE 性能区段, 否则宏展开为空
+#if defined(ENTTWRAP_PROFILE)
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define ENTTWRAP_TSC() __rdtsc()
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define ENTTWRAP_TSC() __rdtsc()
+#else
+#define ENTTWRAP_TSC() static_cast<std::uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count())
+#endif
+#define ENTTWRAP_CONCAT_(a, b) a##b
+#define ENTTWRAP_CONCAT(a, b) ENTTWRAP_CONCAT_(a, b)
+#define ENTTWRAP_ZONE(name) ::entt::ProfileZone ENTTWRAP_CONCAT(enttwrap_zone_, __LINE__)(name)
+#else
+#define ENTTWRAP_ZONE(name)
+#endif
 
 namespace entt {
 
@@ -130,12 +170,797 @@ namespace entt {
         ComponentHandle<Component>& component;
 
         typedef Component ComponentType;
+    };
+
+    //一次 flush 之间创建/销毁的全部实体, entities 只在派发期间有效
+    struct EntitiesCreated {
+        EntitiesCreated(const entity_type* entities, std::size_t count) :
+            entities(entities), count(count) {}
+        const entity_type* entities;
+        std::size_t count;
+
+        const entity_type* begin() const { return entities; }
+        const entity_type* end() const { return entities + count; }
+        std::size_t size() const { return count; }
+    };
+
+    struct EntitiesDestroyed {
+        EntitiesDestroyed(const entity_type* entities, std::size_t count) :
+            entities(entities), count(count) {}
+        const entity_type* entities;
+        std::size_t count;
+
+        const entity_type* begin() const { return entities; }
+        const entity_type* end() const { return entities + count; }
+        std::size_t size() const { return count; }
+    };
+
+    //EventStream 在 EventManager::update 时发出的一批事件, 每个字段一段连续数组, 长度都是 count
+    template <typename Tag, typename ... Fields>
+    struct EventBatch {
+        EventBatch(std::tuple<const Fields*...> fields, std::size_t count) :
+            fields(fields), count(count) {}
+        std::tuple<const Fields*...> fields;
+        std::size_t count;
+
+        template <std::size_t I>
+        const typename std::tuple_element<I, std::tuple<Fields...>>::type* field() const {
+            return std::get<I>(fields);
+        }
+
+        std::size_t size() const { return count; }
+    };
+
+    struct SpatialPoint {
+        float x;
+        float y;
+        float z;
+    };
+
+    //EntityManager::broadcast 发出: 一个事件加上区域内的全部实体, 接收者一次处理整批
+    template <typename Event>
+    struct RegionEvent {
+        RegionEvent(const Event& event, const entity_type* entities, std::size_t count) :
+            event(event), entities(entities), count(count) {}
+        Event event;
+        const entity_type* entities;
+        std::size_t count;
+
+        const entity_type* begin() const { return entities; }
+        const entity_type* end() const { return entities + count; }
+        std::size_t size() const { return count; }
+    };
+
+    template <typename Singleton>
+    struct SingletonChangedEvent {
+        SingletonChangedEvent(Singleton& singleton) :
+            singleton(singleton) {}
+        Singleton& singleton;
+
+        typedef Singleton SingletonType;
+    };
+
+    template <typename Singleton>
+    struct SingletonRemovedEvent {
+        typedef Singleton SingletonType;
+    };
+
+    //把 [0, count) 切成若干段交给多个线程执行 func(begin, end), 数量不够时在当前线程完成
+    template <typename Func>
+    void parallel_for(std::size_t count, std::size_t grain, Func func) {
+        std::size_t workers = std::min<std::size_t>(std::max(1u, std::thread::hardware_concurrency()), count / std::max<std::size_t>(grain, 1));
+        if (workers < 2) {
+            func(std::size_t(0), count);
+            return;
+        }
+        std::vector<std::thread> threads;
+        threads.reserve(workers - 1);
+        for (std::size_t i = 1; i < workers; ++i) {
+            threads.emplace_back(func, count * i / workers, count * (i + 1) / workers);
+        }
+        func(std::size_t(0), count / workers);
+        for (auto &thread : threads) {
+            thread.join();
+        }
+    }
+
+    //Registry::sort 的排序算法参数: 分段并行排序后两两归并, 小于 threshold 时退化成 std::sort
+    //比较函数会被多个线程同时调用, 必须是只读的
+    struct ParallelSort {
+        static constexpr std::size_t threshold = 1 << 14;
+
+        template <typename It, typename Compare>
+        void operator()(It first, It last, Compare compare) const {
+            std::size_t count = std::size_t(last - first);
+            std::size_t workers = std::min<std::size_t>(std::max(1u, std::thread::hardware_concurrency()), count / threshold);
+            if (workers < 2) {
+                std::sort(first, last, compare);
+                return;
+            }
+
+            std::vector<It> bounds;
+            for (std::size_t i = 0; i <= workers; ++i) {
+                bounds.push_back(first + count * i / workers);
+            }
+            parallel_for(workers, 1, [&bounds, &compare](std::size_t begin, std::size_t end) {
+                for (auto i = begin; i < end; ++i) {
+                    std::sort(bounds[i], bounds[i + 1], compare);
+                }
+            });
+            while (bounds.size() > 2) {
+                std::size_t merges = (bounds.size() - 1) / 2;
+                parallel_for(merges, 1, [&bounds, &compare](std::size_t begin, std::size_t end) {
+                    for (auto i = begin; i < end; ++i) {
+                        std::inplace_merge(bounds[2 * i], bounds[2 * i + 1], bounds[2 * i + 2], compare);
+                    }
+                });
+                std::vector<It> merged;
+                for (std::size_t i = 0; i < bounds.size(); i += 2) {
+                    merged.push_back(bounds[i]);
+                }
+                if (merged.back() != bounds.back()) {
+                    merged.push_back(bounds.back());
+                }
+                bounds.swap(merged);
+            }
+        }
+    };
+
+    //稳定的 LSD 基数排序, 每趟 8 位, 所有 key 在某一趟落在同一个桶时跳过这一趟
+    //order 输出按 key 升序的下标, key 相同的保持原来的先后
+    struct RadixSort {
+        static void sort(const std::uint32_t* keys, std::size_t count, std::vector<std::uint32_t>& order, std::vector<std::uint32_t>& scratch) {
+            order.resize(count);
+            scratch.resize(count);
+            for (std::size_t i = 0; i < count; ++i) {
+                order[i] = static_cast<std::uint32_t>(i);
+            }
+            if (count < 2) {
+                return;
+            }
+            for (unsigned shift = 0; shift < 32; shift += 8) {
+                std::size_t offsets[256] = {};
+                for (std::size_t i = 0; i < count; ++i) {
+                    ++offsets[(keys[i] >> shift) & 0xff];
+                }
+                if (offsets[(keys[0] >> shift) & 0xff] == count) {
+                    continue;
+                }
+                std::size_t sum = 0;
+                for (auto &offset : offsets) {
+                    auto size = offset;
+                    offset = sum;
+                    sum += size;
+                }
+                for (std::size_t i = 0; i < count; ++i) {
+                    auto index = order[i];
+                    scratch[offsets[(keys[index] >> shift) & 0xff]++] = index;
+                }
+                order.swap(scratch);
+            }
+        }
+    };
+
+    //预写日志: EntityManager 把实体创建销毁、登记过的 POD 组件的写入和删除顺序追加到这里
+    //记录先攒在内存里, flush() 一次写盘(组提交), 每帧调用一次即可限制 I/O 次数
+    //checkpoint() 在保存快照之后调用, 清空日志并写入新的代号, 恢复时用来核对日志和快照是否对应
+    class Journal {
+    public:
+        enum Op : std::uint8_t {
+            Create = 1,
+            Destroy = 2,
+            Write = 3,
+            Remove = 4
+        };
+
+        struct RecordHeader {
+            std::uint8_t op;
+            std::uint8_t reserved[3];
+            entity_type entity;
+            std::uint32_t type;
+            std::uint32_t size;
+        };
+
+        static constexpr std::uint32_t MAGIC = 0x4c4e524a;
+
+        Journal() = default;
+        Journal(const Journal&) = delete;
+        Journal& operator= (const Journal&) = delete;
+
+        ~Journal() {
+            close();
+        }
+
+        bool open(const std::string& path, std::uint64_t generation = 0) {
+            close();
+            path_ = path;
+            return reset_(generation);
+        }
+
+        void close() {
+            if (file_) {
+                flush();
+                std::fclose(file_);
+                file_ = nullptr;
+            }
+        }
+
+        bool is_open() const {
+            return file_ != nullptr;
+        }
+
+        //hold 期间只写到 hold 时的位置
+        void flush() {
+            std::size_t size = holding_ ? held_ : buffer_.size();
+            if (file_ && size) {
+                std::fwrite(buffer_.data(), 1, size, file_);
+                std::fflush(file_);
+                bytes_written_ += size;
+                buffer_.erase(buffer_.begin(), buffer_.begin() + size);
+                held_ = 0;
+            }
+        }
+
+        //事务用: hold 之后追加的记录留在内存里, release 时放行, discard 时丢掉; 崩溃时不会只写下半个事务
+        void hold() {
+            holding_ = true;
+            held_ = buffer_.size();
+            held_records_ = records_;
+        }
+
+        void release() {
+            holding_ = false;
+            if (buffer_.size() >= flush_threshold) {
+                flush();
+            }
+        }
+
+        void discard() {
+            if (holding_) {
+                buffer_.resize(held_);
+                records_ = held_records_;
+                holding_ = false;
+            }
+        }
+
+        bool checkpoint(std::uint64_t generation) {
+            assert(file_ && "Journal::open() not called");
+            buffer_.clear();
+            held_ = 0;
+            std::fclose(file_);
+            file_ = nullptr;
+            return reset_(generation);
+        }
+
+        void append(Op op, entity_type entity, std::uint32_t type = 0, const void* data = nullptr, std::uint32_t size = 0) {
+            RecordHeader header = { op, { 0, 0, 0 }, entity, type, size };
+            auto bytes = reinterpret_cast<const unsigned char*>(&header);
+            buffer_.insert(buffer_.end(), bytes, bytes + sizeof(header));
+            if (size) {
+                auto payload = static_cast<const unsigned char*>(data);
+                buffer_.insert(buffer_.end(), payload, payload + size);
+            }
+            ++records_;
+            if (!holding_ && buffer_.size() >= flush_threshold) {
+                flush();
+            }
+        }
+
+        std::uint64_t generation() const { return generation_; }
+        std::size_t records() const { return records_; }
+        std::size_t bytes_written() const { return bytes_written_; }
+
+        //缓冲超过这个大小时不等 flush() 直接写盘
+        std::size_t flush_threshold = 1 << 20;
+
+    private:
+        bool reset_(std::uint64_t generation) {
+            file_ = std::fopen(path_.c_str(), "wb");
+            if (!file_) {
+                return false;
+            }
+            generation_ = generation;
+            std::uint32_t magic = MAGIC;
+            std::fwrite(&magic, sizeof(magic), 1, file_);
+            std::fwrite(&generation_, sizeof(generation_), 1, file_);
+            std::fflush(file_);
+            return true;
+        }
+
+        std::FILE* file_ = nullptr;
+        std::string path_;
+        std::vector<unsigned char> buffer_;
+        std::uint64_t generation_ = 0;
+        std::size_t records_ = 0;
+        std::size_t bytes_written_ = 0;
+        bool holding_ = false;
+        std::size_t held_ = 0;
+        std::size_t held_records_ = 0;
     };
 
+    //冷存储用的 LZ 压缩, 格式同 LZ4 block: token(字面量长度<<4 | 匹配长度-4), 字面量, 2 字节偏移, 超过 15 的长度用 255 续写
+    struct ColdCodec {
+        static void compress(const unsigned char* in, std::size_t size, std::vector<unsigned char>& out) {
+            static const std::size_t min_match = 4;
+            static const std::uint32_t none = 0xffffffff;
+            std::vector<std::uint32_t> table(1 << 12, none);
+            std::size_t anchor = 0;
+            std::size_t pos = 0;
+            out.clear();
+            while (pos + min_match <= size) {
+                std::uint32_t sequence;
+                std::memcpy(&sequence, in + pos, sizeof(sequence));
+                auto hash = (sequence * 2654435761u) >> 20;
+                std::uint32_t candidate = table[hash];
+                table[hash] = std::uint32_t(pos);
+                std::uint32_t previous;
+                if (candidate != none && pos - candidate <= 0xffff
+                    && (std::memcpy(&previous, in + candidate, sizeof(previous)), previous == sequence)) {
+                    std::size_t length = min_match;
+                    while (pos + length < size && in[candidate + length] == in[pos + length]) {
+                        ++length;
+                    }
+                    emit_(out, in + anchor, pos - anchor, pos - candidate, length - min_match, true);
+                    pos += length;
+                    anchor = pos;
+                } else {
+                    ++pos;
+                }
+            }
+            emit_(out, in + anchor, size - anchor, 0, 0, false);
+        }
+
+        //out 必须已经是原始大小
+        static void decompress(const unsigned char* in, std::size_t size, std::vector<unsigned char>& out) {
+            std::size_t pos = 0;
+            std::size_t written = 0;
+            while (pos < size) {
+                unsigned char token = in[pos++];
+                std::size_t literals = read_length_(in, pos, token >> 4);
+                if (literals) {
+                    std::memcpy(out.data() + written, in + pos, literals);
+                }
+                pos += literals;
+                written += literals;
+                if (pos >= size) {
+                    break;
+                }
+                std::size_t offset = in[pos] | (std::size_t(in[pos + 1]) << 8);
+                pos += 2;
+                std::size_t length = read_length_(in, pos, token & 0x0f) + 4;
+                for (std::size_t i = 0; i < length; ++i, ++written) {
+                    out[written] = out[written - offset];
+                }
+            }
+        }
+
+    private:
+        static void emit_(std::vector<unsigned char>& out, const unsigned char* literals, std::size_t count, std::size_t offset, std::size_t length, bool match) {
+            out.push_back(static_cast<unsigned char>((std::min<std::size_t>(count, 15) << 4) | std::min<std::size_t>(length, 15)));
+            write_length_(out, count);
+            out.insert(out.end(), literals, literals + count);
+            if (match) {
+                out.push_back(static_cast<unsigned char>(offset & 0xff));
+                out.push_back(static_cast<unsigned char>(offset >> 8));
+                write_length_(out, length);
+            }
+        }
+
+        static void write_length_(std::vector<unsigned char>& out, std::size_t length) {
+            if (length >= 15) {
+                for (length -= 15; length >= 255; length -= 255) {
+                    out.push_back(255);
+                }
+                out.push_back(static_cast<unsigned char>(length));
+            }
+        }
+
+        static std::size_t read_length_(const unsigned char* in, std::size_t& pos, std::size_t length) {
+            if (length == 15) {
+                unsigned char byte;
+                do {
+                    byte = in[pos++];
+                    length += byte;
+                } while (byte == 255);
+            }
+            return length;
+        }
+    };
+
+    struct ColdStats {
+        std::size_t pages = 0;
+        std::size_t entities = 0;
+        std::size_t raw_bytes = 0;
+        std::size_t compressed_bytes = 0;
+
+        std::size_t saved_bytes() const {
+            return raw_bytes > compressed_bytes ? raw_bytes - compressed_bytes : 0;
+        }
+    };
+
+    //休眠实体的磁盘存储: 只追加写, 按偏移随机读; 唤醒后的记录不回收, 重新 open 时清空
+    class HibernationStore {
+    public:
+        HibernationStore() = default;
+        HibernationStore(const HibernationStore&) = delete;
+        HibernationStore& operator= (const HibernationStore&) = delete;
+
+        ~HibernationStore() {
+            close();
+        }
+
+        bool open(const std::string& path) {
+            close();
+            file_ = std::fopen(path.c_str(), "w+b");
+            size_ = 0;
+            return file_ != nullptr;
+        }
+
+        void close() {
+            if (file_) {
+                std::fclose(file_);
+                file_ = nullptr;
+            }
+        }
+
+        bool is_open() const {
+            return file_ != nullptr;
+        }
+
+        //写入并刷到文件后才返回 true, offset 为数据的起始位置; 写失败时文件大小不变, 下次追加覆盖写坏的部分
+        bool append(const unsigned char* data, std::size_t size, std::uint64_t& offset) {
+            assert(file_ && "HibernationStore::open() not called");
+            offset = size_;
+            if (!seek_(offset) || std::fwrite(data, 1, size, file_) != size || std::fflush(file_) != 0) {
+                std::clearerr(file_);
+                return false;
+            }
+            size_ += size;
+            return true;
+        }
+
+        bool read(std::uint64_t offset, std::size_t size, unsigned char* out) {
+            assert(file_ && "HibernationStore::open() not called");
+            return seek_(offset) && std::fread(out, 1, size, file_) == size;
+        }
+
+        std::uint64_t size() const {
+            return size_;
+        }
+
+    private:
+        bool seek_(std::uint64_t offset) {
+#if defined(_MSC_VER)
+            return _fseeki64(file_, static_cast<__int64>(offset), SEEK_SET) == 0;
+#else
+            return fseeko(file_, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+        }
+
+        std::FILE* file_ = nullptr;
+        std::uint64_t size_ = 0;
+    };
+
+#if defined(ENTTWRAP_PROFILE)
+    //每个线程一块缓冲, 写入不加锁, 只有线程第一次使用时登记一次
+    //write_trace 输出 chrome://tracing 格式, 调用时各线程应当处于空闲状态(比如两帧之间)
+    class Profiler {
+    public:
+        struct Record {
+            const char* name;
+            std::uint64_t tsc;
+            bool begin;
+        };
+
+        struct ThreadBuffer {
+            std::vector<Record> records;
+            std::uint32_t thread = 0;
+        };
+
+        static ThreadBuffer& local() {
+            thread_local ThreadBuffer* buffer = register_();
+            return *buffer;
+        }
+
+        static void begin(const char* name) {
+            local().records.push_back({ name, ENTTWRAP_TSC(), true });
+        }
+
+        static void end(const char* name) {
+            local().records.push_back({ name, ENTTWRAP_TSC(), false });
+        }
+
+        static void clear() {
+            State& state = state_();
+            std::lock_guard<std::mutex> lock(state.mutex);
+            for (auto& buffer : state.buffers) {
+                buffer->records.clear();
+            }
+        }
+
+        static bool write_trace(const std::string& path) {
+            State& state = state_();
+            std::lock_guard<std::mutex> lock(state.mutex);
+            std::FILE* file = std::fopen(path.c_str(), "w");
+            if (!file) {
+                return false;
+            }
+            //用启动以来的稳定时钟校准 TSC 频率
+            auto elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - state.start).count();
+            double ticks_per_us = elapsed > 0 ? double(ENTTWRAP_TSC() - state.start_tsc) / elapsed : 1.0;
+
+            std::fputs("{\"traceEvents\":[", file);
+            bool first = true;
+            for (auto& buffer : state.buffers) {
+                for (auto& record : buffer->records) {
+                    std::fprintf(file, "%s\n{\"name\":\"", first ? "" : ",");
+                    for (const char* c = record.name; *c; ++c) {
+                        if (*c == '"' || *c == '\\') {
+                            std::fputc('\\', file);
+                        }
+                        std::fputc(*c, file);
+                    }
+                    std::fprintf(file, "\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":0,\"tid\":%u}",
+                        record.begin ? 'B' : 'E', double(record.tsc - state.start_tsc) / ticks_per_us, buffer->thread);
+                    first = false;
+                }
+            }
+            std::fputs("\n]}\n", file);
+            std::fclose(file);
+            return true;
+        }
+
+    private:
+        struct State {
+            std::mutex mutex;
+            std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            std::uint64_t start_tsc = ENTTWRAP_TSC();
+        };
+
+        static State& state_() {
+            static State state;
+            return state;
+        }
+
+        static ThreadBuffer* register_() {
+            State& state = state_();
+            std::lock_guard<std::mutex> lock(state.mutex);
+            state.buffers.emplace_back(new ThreadBuffer());
+            state.buffers.back()->thread = std::uint32_t(state.buffers.size() - 1);
+            state.buffers.back()->records.reserve(1 << 14);
+            return state.buffers.back().get();
+        }
+    };
+
+    class ProfileZone {
+    public:
+        ProfileZone(const char* name) : name_(name) {
+            Profiler::begin(name_);
+        }
+        ~ProfileZone() {
+            Profiler::end(name_);
+        }
+        ProfileZone(const ProfileZone&) = delete;
+        ProfileZone& operator= (const ProfileZone&) = delete;
+    private:
+        const char* name_;
+    };
+#endif
+
+    //一种事件的全部接收者, 作为唯一的接收者挂在 Dispatcher 上, 按优先级从高到低调用, 同优先级按订阅顺序
+    //receive 返回 bool 的接收者返回 true 表示事件已被处理, 后面的接收者不再调用; 返回 void 的从不截断
+    //派发过程中的订阅/取消订阅在本次派发结束后生效
+    class BaseListenerChannel {
+    public:
+        virtual ~BaseListenerChannel() = default;
+    };
+
+    template <typename Event>
+    class ListenerChannel : public BaseListenerChannel {
+        struct Listener {
+            void* instance;
+            bool(*call)(void*, const Event&);
+            int priority;
+            std::size_t order;
+        };
+
+    public:
+        template <typename Receiver>
+        void connect(Receiver* receiver, int priority) {
+            disconnect(receiver);
+            Listener listener{ receiver, &ListenerChannel::call_<Receiver>, priority, order_++ };
+            if (dispatching_) {
+                pending_.push_back(listener);
+            } else {
+                insert_(listener);
+            }
+        }
+
+        void disconnect(const void* receiver) {
+            for (auto& listener : listeners_) {
+                if (listener.instance == receiver) {
+                    listener.instance = nullptr;
+                    dirty_ = true;
+                }
+            }
+            pending_.erase(std::remove_if(pending_.begin(), pending_.end(), [receiver](const Listener& listener) {
+                return listener.instance == receiver;
+            }), pending_.end());
+            if (!dispatching_) {
+                compact_();
+            }
+        }
+
+        void receive(const Event& event) {
+            ++dispatching_;
+            for (std::size_t i = 0, size = listeners_.size(); i < size; ++i) {
+                if (listeners_[i].instance && listeners_[i].call(listeners_[i].instance, event)) {
+                    break;
+                }
+            }
+            if (--dispatching_ == 0) {
+                compact_();
+                for (auto& listener : pending_) {
+                    insert_(listener);
+                }
+                pending_.clear();
+            }
+        }
+
+        template <typename Receiver>
+        static bool invoke(Receiver* receiver, const Event& event) {
+            using result_type = decltype(receiver->receive(event));
+            return invoke_(receiver, event, std::is_same<result_type, bool>{});
+        }
+
+    private:
+        template <typename Receiver>
+        static bool call_(void* instance, const Event& event) {
+            return invoke(static_cast<Receiver*>(instance), event);
+        }
+
+        template <typename Receiver>
+        static bool invoke_(Receiver* receiver, const Event& event, std::true_type) {
+            return receiver->receive(event);
+        }
+
+        template <typename Receiver>
+        static bool invoke_(Receiver* receiver, const Event& event, std::false_type) {
+            receiver->receive(event);
+            return false;
+        }
+
+        void insert_(const Listener& listener) {
+            auto it = std::upper_bound(listeners_.begin(), listeners_.end(), listener, [](const Listener& lhs, const Listener& rhs) {
+                return lhs.priority > rhs.priority;
+            });
+            listeners_.insert(it, listener);
+        }
+
+        void compact_() {
+            if (dirty_) {
+                listeners_.erase(std::remove_if(listeners_.begin(), listeners_.end(), [](const Listener& listener) {
+                    return listener.instance == nullptr;
+                }), listeners_.end());
+                dirty_ = false;
+            }
+        }
+
+        std::vector<Listener> listeners_;
+        std::vector<Listener> pending_;
+        std::size_t order_ = 0;
+        std::size_t dispatching_ = 0;
+        bool dirty_ = false;
+    };
+
+    //(事件类型, 接收者) 的派发统计; events 是该事件类型发出的总数
+    struct ListenerStats {
+        const char* event = nullptr;
+        const char* receiver = nullptr;
+        std::uint64_t calls = 0;
+        std::uint64_t events = 0;
+        double seconds = 0;
+    };
+
+    //有界队列满了以后的处理方式
+    //DropOldest: 丢掉队头最旧的事件; DropNewest: 丢掉新来的事件
+    //Coalesce: 和队列里 key 相同的事件合并(新值覆盖旧值, 位置不变), 没有相同 key 时退化为 DropOldest
+    //Block: 只对别的线程上的生产者有效, 等到 update 取走队列; 消费线程(调用 update 的线程)自己 enqueue 时不能等, 退化为 DropNewest
+    //       最多等 set_queue_block_timeout 设置的时间, 超时或 close_queues 之后退化为 DropOldest, 消费者不再 update 时生产者不会一直卡住
+    //消费线程一开始是构造 EventManager 的线程, 之后是最近一次调用 update 的线程, 也可以用 set_consumer_thread 指定
+    enum class QueuePolicy : std::uint8_t {
+        DropOldest,
+        DropNewest,
+        Coalesce,
+        Block
+    };
+
+    //high_water 是两次 update 之间队列长度的最大值
+    struct QueueStats {
+        std::size_t capacity = 0;
+        std::size_t size = 0;
+        std::size_t high_water = 0;
+        std::uint64_t dropped = 0;
+        std::uint64_t coalesced = 0;
+        std::uint64_t blocked = 0;
+    };
+
+    class BaseEventStream {
+    public:
+        virtual ~BaseEventStream() = default;
+        //返回派发的 EventBatch 个数(0 或 1)
+        virtual std::size_t flush(Dispatcher& dispatcher) = 0;
+        std::size_t event_family = 0;   //EventBatch 在 EventManager 里的事件编号, 用来计数
+    };
+
+    //大量同类事件(命中、脚步等)按字段分列存放, update 时作为一个 EventBatch<Tag, Fields...> 整批派发
+    //Tag 只用来区分字段类型相同的两种流; 接收者订阅 EventBatch<Tag, Fields...>
+    template <typename Tag, typename ... Fields>
+    class EventStream : public BaseEventStream {
+    public:
+        void push(const Fields& ... values) {
+            push_(std::index_sequence_for<Fields...>{}, values...);
+        }
+
+        void reserve(std::size_t capacity) {
+            reserve_(std::index_sequence_for<Fields...>{}, capacity);
+        }
+
+        std::size_t size() const {
+            return size_;
+        }
+
+        //派发期间 push 的事件写进另一组数组, 留到下一次 update
+        std::size_t flush(Dispatcher& dispatcher) override {
+            if (!size_) {
+                return 0;
+            }
+            columns_.swap(batch_);
+            auto count = size_;
+            size_ = 0;
+            dispatcher.trigger<EventBatch<Tag, Fields...>>(EventBatch<Tag, Fields...>(data_(std::index_sequence_for<Fields...>{}), count));
+            clear_(std::index_sequence_for<Fields...>{});
+            return 1;
+        }
+
+    private:
+        template <std::size_t ... I>
+        void push_(std::index_sequence<I...>, const Fields& ... values) {
+            using accumulator_type = int[];
+            accumulator_type accumulator = { 0, (std::get<I>(columns_).push_back(values), 0)... };
+            (void)accumulator;
+            ++size_;
+        }
+
+        template <std::size_t ... I>
+        void reserve_(std::index_sequence<I...>, std::size_t capacity) {
+            using accumulator_type = int[];
+            accumulator_type accumulator = { 0, (std::get<I>(columns_).reserve(capacity), std::get<I>(batch_).reserve(capacity), 0)... };
+            (void)accumulator;
+        }
+
+        template <std::size_t ... I>
+        std::tuple<const Fields*...> data_(std::index_sequence<I...>) const {
+            return std::tuple<const Fields*...>(std::get<I>(batch_).data()...);
+        }
+
+        template <std::size_t ... I>
+        void clear_(std::index_sequence<I...>) {
+            using accumulator_type = int[];
+            accumulator_type accumulator = { 0, (std::get<I>(batch_).clear(), 0)... };
+            (void)accumulator;
+        }
+
+        std::tuple<std::vector<Fields>...> columns_;
+        std::tuple<std::vector<Fields>...> batch_;
+        std::size_t size_ = 0;
+    };
+
     class EventManager
     {
     public:
-        EventManager() {
+        EventManager() : consumer_(std::this_thread::get_id()) {
             dispatcher = std::make_shared<entt::Dispatcher>();
         }
 
@@ -143,18 +968,33 @@ namespace entt {
 
 
         //---------------------------system专用--------------------------
+        //priority 大的先调用, 见 ListenerChannel; 重复订阅只保留最后一次
         template <typename Event, typename Receiver>
-        void subscribe(Receiver& receiver)
+        void subscribe(Receiver& receiver, int priority = 0)
         {
-
-            dispatcher->sink<Event>().connect(&receiver);
+            unsubscribe<Event>(receiver);
+            auto &channel = channel_<Event>();
+            if (instrumented_) {
+                auto probe = probe_<Event>(receiver);
+                probe->connected = true;
+                channel.connect(probe, priority);
+                return;
+            }
+            channel.connect(&receiver, priority);
         }
 
 
         template <typename Event, typename Receiver>
         void unsubscribe(Receiver& receiver)
         {
-            dispatcher->sink<Event>().disconnect(&receiver);
+            auto &channel = channel_<Event>();
+            for (auto &probe : probes_) {
+                if (probe->connected && probe->receiver_address == &receiver && probe->event_family == event_family::type<Event>()) {
+                    channel.disconnect(probe.get());
+                    probe->connected = false;
+                }
+            }
+            channel.disconnect(&receiver);
         }
 
 
@@ -162,54 +1002,678 @@ namespace entt {
         template <typename Event>
         void emit(const Event &event)
         {
+            count_event_<Event>();
+            bump_version_<Event>();
             dispatcher->trigger<Event>(event);
         }
 
         template <typename Event, typename ... Args>
         void emit(Args && ... args) {
+            count_event_<Event>();
+            bump_version_<Event>();
             Event event = Event(std::forward<Args>(args) ...);
             dispatcher->trigger<Event>(event);
         }
 
-        //放到队列
+        //放到队列; 设置了上限或派发顺序的事件不在这里计数, 由 update 派发时在消费线程上计数, 生产线程不碰计数器
         template <typename Event>
         void enqueue(const Event &event)
         {
+            auto family = event_family::type<Event>();
+            if (family < queues_.size() && queues_[family]) {
+                static_cast<BoundedQueue<Event>*>(queues_[family].get())->push(event, consumer_.load());
+                return;
+            }
+            count_event_<Event>();
+            bump_version_<Event>();
             dispatcher->enqueue<Event>(event);
         }
 
         void update()
         {
+            consumer_ = std::this_thread::get_id();
             dispatcher->update();
-        }
-    };
-    class EntityManager :public DefaultRegistry
-    {
-        using view_type = SparseSet<std::uint32_t>;
-        using iterator_type = typename view_type::iterator_type;
-        class EntityIter
-        {
-        public:
-            EntityIter(EntityManager& entityManager, iterator_type& iter)
-                : iter_(iter)
-                , entity_manager_(entityManager) {
-            }
-            bool operator!= (const EntityIter& other) const
-            {
-                bool b = (iter_ != other.iter_);
-                return b;
-            }
-            Entity operator* () const {
-                return entity_manager_.getEntity(*iter_);
-            };
-            const EntityIter& operator++ ()
-            {
-                ++iter_;
-                return *this;
-            }
-        private:
-            iterator_type iter_;
-            EntityManager& entity_manager_;
+            for (std::size_t family = 0; family < queues_.size(); ++family) {
+                if (queues_[family]) {
+                    count_events_(family, queues_[family]->drain(*dispatcher));
+                }
+            }
+            for (auto &stream : streams_) {
+                if (stream) {
+                    count_events_(stream->event_family, stream->flush(*dispatcher));
+                }
+            }
+        }
+
+        //调用 update 的线程, QueuePolicy::Block 在这个线程上不等待
+        void set_consumer_thread(std::thread::id consumer = std::this_thread::get_id()) {
+            consumer_ = consumer;
+        }
+
+        //---------------------------事件流--------------------------
+        template <typename Tag, typename ... Fields>
+        EventStream<Tag, Fields...>& stream() {
+            auto family = stream_family::type<EventStream<Tag, Fields...>>();
+            if (!(family < streams_.size())) {
+                streams_.resize(family + 1);
+            }
+            if (!streams_[family]) {
+                streams_[family].reset(new EventStream<Tag, Fields...>());
+                streams_[family]->event_family = event_family::type<EventBatch<Tag, Fields...>>();
+            }
+            return *static_cast<EventStream<Tag, Fields...>*>(streams_[family].get());
+        }
+
+        //---------------------------有界队列--------------------------
+        //给一种事件的 enqueue 设置上限, 之后这种事件不再进 Dispatcher 的队列, 在 update 时按入队顺序派发
+        //key 只在 Coalesce 下使用, 不给时所有事件的 key 相同, 即只保留最新的一个
+        //有界队列加锁, 可以从别的线程 enqueue; 设置上限要在开始 enqueue 之前
+        template <typename Event>
+        void set_queue_bound(std::size_t capacity, QueuePolicy policy = QueuePolicy::DropOldest, std::function<std::uint64_t(const Event&)> key = nullptr) {
+            assert(capacity > 0);
+            auto &queue = queue_<Event>();
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.stats_.capacity = capacity;
+            queue.policy = policy;
+            queue.key = std::move(key);
+        }
+
+        //Block 等待的上限, 默认 100ms
+        template <typename Event>
+        void set_queue_block_timeout(std::chrono::milliseconds timeout) {
+            auto &queue = queue_<Event>();
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.block_timeout = timeout;
+        }
+
+        //停止消费前调用(比如退出时): 唤醒等待中的生产者, 之后 Block 不再等待
+        void close_queues() {
+            for (auto &queue : queues_) {
+                if (queue) {
+                    std::lock_guard<std::mutex> lock(queue->mutex);
+                    queue->closed = true;
+                    queue->drained.notify_all();
+                }
+            }
+        }
+
+        template <typename Event>
+        void clear_queue_bound() {
+            auto family = event_family::type<Event>();
+            if (family < queues_.size() && queues_[family]) {
+                auto &queue = *static_cast<BoundedQueue<Event>*>(queues_[family].get());
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                queue.stats_.capacity = std::numeric_limits<std::size_t>::max();
+                queue.policy = QueuePolicy::DropOldest;
+                queue.key = nullptr;
+                queue.drained.notify_all();
+            }
+        }
+
+        //update 派发这种事件前, 按 order(event) 做稳定的基数排序, 让接收者按实体顺序访问组件
+        //order 一般返回事件携带的实体下标 (entity & entity_mask), 也可以返回实体在某个组件池里的位置
+        //order 在 update 时调用, 可以读 EntityManager; 和 set_queue_bound 可以同时使用
+        template <typename Event>
+        void set_queue_order(std::function<std::uint32_t(const Event&)> order) {
+            auto &queue = queue_<Event>();
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.order = std::move(order);
+        }
+
+        template <typename Event>
+        void clear_queue_order() {
+            auto family = event_family::type<Event>();
+            if (family < queues_.size() && queues_[family]) {
+                auto &queue = *static_cast<BoundedQueue<Event>*>(queues_[family].get());
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                queue.order = nullptr;
+            }
+        }
+
+        template <typename Event>
+        QueueStats queue_stats() const {
+            auto family = event_family::type<Event>();
+            return family < queues_.size() && queues_[family] ? queues_[family]->stats() : QueueStats();
+        }
+
+        //清零计数和 high_water, capacity 和 size 不变
+        void reset_queue_stats() {
+            for (auto &queue : queues_) {
+                if (queue) {
+                    queue->reset_stats();
+                }
+            }
+        }
+
+        //---------------------------变更计数--------------------------
+        //watch_event 之后这种事件每次 emit/enqueue 计数加一, 返回的编号传给 event_version; 响应式系统用它判断要不要运行
+        //设置了上限或派发顺序的事件和 EventStream 的 EventBatch 在 update 派发时计数, 被丢弃或合并的不计
+        template <typename Event>
+        std::size_t watch_event() {
+            auto family = event_family::type<Event>();
+            if (!(family < event_versions_.size())) {
+                event_versions_.resize(family + 1);
+            }
+            return family;
+        }
+
+        std::uint64_t event_version(std::size_t family) const {
+            return family < event_versions_.size() ? event_versions_[family] : 0;
+        }
+
+        //---------------------------派发统计--------------------------
+        //打开后新订阅的接收者经过一层计时代理, 按 (事件, 接收者) 统计耗时和调用次数
+        //开启 ENTTWRAP_PROFILE 时每次调用还会在 Profiler 里记一个 "事件 -> 接收者" 区段, 和系统区段在同一份 trace 里
+        //已经订阅的接收者不受影响, 所以要在 configure 之前打开
+        void set_instrumentation(bool enabled) {
+            instrumented_ = enabled;
+        }
+
+        bool instrumented() const {
+            return instrumented_;
+        }
+
+        //只包含当前订阅着的监听者
+        std::vector<ListenerStats> listener_stats() const {
+            std::vector<ListenerStats> stats;
+            for (auto &probe : probes_) {
+                if (!probe->connected) {
+                    continue;
+                }
+                stats.push_back(probe->stats);
+                stats.back().events = probe->event_family < event_counts_.size() ? event_counts_[probe->event_family] : 0;
+            }
+            return stats;
+        }
+
+        void reset_listener_stats() {
+            for (auto &probe : probes_) {
+                probe->stats.calls = 0;
+                probe->stats.seconds = 0;
+            }
+            std::fill(event_counts_.begin(), event_counts_.end(), 0);
+        }
+
+    private:
+        using event_family = Family<struct EventFamily>;
+        using stream_family = Family<struct StreamFamily>;
+
+        struct BaseListenerProbe {
+            virtual ~BaseListenerProbe() = default;
+            ListenerStats stats;
+            std::string zone;
+            const void* receiver_address = nullptr;
+            std::size_t event_family = 0;
+            bool connected = true;
+        };
+
+        //取消订阅后代理不释放, 保证 trace 里的区段名一直有效; 同一个 (事件, 接收者) 再次订阅时复用
+        template <typename Event, typename Receiver>
+        struct ListenerProbe : BaseListenerProbe {
+            ListenerProbe(Receiver& receiver) : target(&receiver) {
+                stats.event = typeid(Event).name();
+                stats.receiver = typeid(Receiver).name();
+                zone = std::string(stats.event) + " -> " + stats.receiver;
+                receiver_address = &receiver;
+                event_family = EventManager::event_family::type<Event>();
+            }
+
+            bool receive(const Event &event) {
+                ENTTWRAP_ZONE(zone.c_str());
+                auto start = std::chrono::steady_clock::now();
+                bool consumed = ListenerChannel<Event>::invoke(target, event);
+                stats.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                ++stats.calls;
+                return consumed;
+            }
+
+            Receiver* target;
+        };
+
+        template <typename Event, typename Receiver>
+        ListenerProbe<Event, Receiver>* probe_(Receiver& receiver) {
+            for (auto &probe : probes_) {
+                auto existing = dynamic_cast<ListenerProbe<Event, Receiver>*>(probe.get());
+                if (existing && existing->target == &receiver) {
+                    return existing;
+                }
+            }
+            auto probe = new ListenerProbe<Event, Receiver>(receiver);
+            probes_.emplace_back(probe);
+            return probe;
+        }
+
+        template <typename Event>
+        void count_event_() {
+            if (instrumented_) {
+                auto family = event_family::type<Event>();
+                if (!(family < event_counts_.size())) {
+                    event_counts_.resize(family + 1);
+                }
+                ++event_counts_[family];
+            }
+        }
+
+        struct BaseBoundedQueue {
+            virtual ~BaseBoundedQueue() = default;
+            //返回派发的事件数
+            virtual std::size_t drain(Dispatcher& dispatcher) = 0;
+
+            QueueStats stats() {
+                std::lock_guard<std::mutex> lock(mutex);
+                return stats_;
+            }
+
+            void reset_stats() {
+                std::lock_guard<std::mutex> lock(mutex);
+                stats_.high_water = stats_.size;
+                stats_.dropped = 0;
+                stats_.coalesced = 0;
+                stats_.blocked = 0;
+            }
+
+            std::mutex mutex;
+            std::condition_variable drained;
+            QueueStats stats_;
+            std::chrono::milliseconds block_timeout{ 100 };
+            bool closed = false;
+        };
+
+        //events 里第 i 个事件的序号是 head + i, latest 记录每个 key 最后入队的序号
+        //没有设置上限时 capacity 是 size_t 的最大值
+        template <typename Event>
+        struct BoundedQueue : BaseBoundedQueue {
+            struct Entry {
+                Event event;
+                std::uint64_t key;
+            };
+
+            BoundedQueue() {
+                stats_.capacity = std::numeric_limits<std::size_t>::max();
+            }
+
+            void push(const Event& event, std::thread::id consumer) {
+                std::unique_lock<std::mutex> lock(mutex);
+                std::uint64_t k = policy == QueuePolicy::Coalesce && key ? key(event) : 0;
+                if (policy == QueuePolicy::Coalesce) {
+                    auto it = latest.find(k);
+                    if (it != latest.end()) {
+                        events[static_cast<std::size_t>(it->second - head)].event = event;
+                        ++stats_.coalesced;
+                        return;
+                    }
+                }
+                if (!(events.size() < stats_.capacity)) {
+                    switch (policy) {
+                    case QueuePolicy::DropNewest:
+                        ++stats_.dropped;
+                        return;
+                    case QueuePolicy::Block:
+                        if (consumer == std::this_thread::get_id()) {
+                            ++stats_.dropped;
+                            return;
+                        }
+                        ++stats_.blocked;
+                        if (!drained.wait_for(lock, block_timeout, [this] { return closed || events.size() < stats_.capacity; })
+                            || !(events.size() < stats_.capacity)) {
+                            pop_front_();
+                            ++stats_.dropped;
+                        }
+                        break;
+                    default:
+                        pop_front_();
+                        ++stats_.dropped;
+                        break;
+                    }
+                }
+                if (policy == QueuePolicy::Coalesce) {
+                    latest[k] = head + events.size();
+                }
+                events.push_back(Entry{ event, k });
+                stats_.size = events.size();
+                stats_.high_water = std::max(stats_.high_water, stats_.size);
+            }
+
+            //先整体取出再派发, 接收者在派发中 enqueue 的事件留到下一次 update
+            std::size_t drain(Dispatcher& dispatcher) override {
+                std::deque<Entry> batch;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    batch.swap(events);
+                    head += batch.size();
+                    latest.clear();
+                    stats_.size = 0;
+                }
+                drained.notify_all();
+                if (!order || batch.size() < 2) {
+                    for (auto &entry : batch) {
+                        dispatcher.trigger<Event>(entry.event);
+                    }
+                    return batch.size();
+                }
+                keys.resize(batch.size());
+                for (std::size_t i = 0; i < batch.size(); ++i) {
+                    keys[i] = order(batch[i].event);
+                }
+                RadixSort::sort(keys.data(), keys.size(), permutation, scratch);
+                for (auto index : permutation) {
+                    dispatcher.trigger<Event>(batch[index].event);
+                }
+                return batch.size();
+            }
+
+            void pop_front_() {
+                auto it = latest.find(events.front().key);
+                if (it != latest.end() && it->second == head) {
+                    latest.erase(it);
+                }
+                events.pop_front();
+                ++head;
+            }
+
+            QueuePolicy policy = QueuePolicy::DropOldest;
+            std::function<std::uint64_t(const Event&)> key;
+            std::function<std::uint32_t(const Event&)> order;
+            std::vector<std::uint32_t> keys;
+            std::vector<std::uint32_t> permutation;
+            std::vector<std::uint32_t> scratch;
+            std::deque<Entry> events;
+            std::uint64_t head = 0;
+            std::unordered_map<std::uint64_t, std::uint64_t> latest;
+        };
+
+        //update 里按事件编号计数, 和 count_event_/bump_version_ 效果相同
+        void count_events_(std::size_t family, std::size_t count) {
+            if (!count) {
+                return;
+            }
+            if (instrumented_) {
+                if (!(family < event_counts_.size())) {
+                    event_counts_.resize(family + 1);
+                }
+                event_counts_[family] += count;
+            }
+            if (family < event_versions_.size()) {
+                event_versions_[family] += count;
+            }
+        }
+
+        template <typename Event>
+        void bump_version_() {
+            auto family = event_family::type<Event>();
+            if (family < event_versions_.size()) {
+                ++event_versions_[family];
+            }
+        }
+
+        template <typename Event>
+        BoundedQueue<Event>& queue_() {
+            auto family = event_family::type<Event>();
+            if (!(family < queues_.size())) {
+                queues_.resize(family + 1);
+            }
+            if (!queues_[family]) {
+                queues_[family].reset(new BoundedQueue<Event>());
+            }
+            return *static_cast<BoundedQueue<Event>*>(queues_[family].get());
+        }
+
+        template <typename Event>
+        ListenerChannel<Event>& channel_() {
+            auto family = event_family::type<Event>();
+            if (!(family < channels_.size())) {
+                channels_.resize(family + 1);
+            }
+            if (!channels_[family]) {
+                auto channel = new ListenerChannel<Event>();
+                channels_[family].reset(channel);
+                dispatcher->sink<Event>().connect(channel);
+            }
+            return *static_cast<ListenerChannel<Event>*>(channels_[family].get());
+        }
+
+        std::vector<std::unique_ptr<BaseListenerChannel>> channels_;
+        std::vector<std::unique_ptr<BaseBoundedQueue>> queues_;
+        std::vector<std::unique_ptr<BaseEventStream>> streams_;
+        std::atomic<std::thread::id> consumer_;
+        bool instrumented_ = false;
+        std::vector<std::unique_ptr<BaseListenerProbe>> probes_;
+        std::vector<std::uint64_t> event_counts_;
+        std::vector<std::uint64_t> event_versions_;
+    };
+
+    //两个 EventManager (通常各自在一个线程上) 之间的事件桥, 每个方向一个单生产者单消费者的环形缓冲
+    //send 只写本地位置, flush 时才对另一边可见; pump 一次取走对面 flush 过的全部事件并在本地 emit
+    //收发都不加锁、不分配内存, 事件必须可平凡复制, 且要先在两边开始收发之前 route
+    //同一种事件不要在两个方向都 forward, 否则会来回转发
+    class EventBridge {
+        struct Ring {
+            explicit Ring(std::size_t capacity) : buffer(capacity / sizeof(std::uint64_t)) {}
+
+            std::vector<std::uint64_t> buffer;
+            alignas(64) std::atomic<std::uint64_t> head{ 0 };   //消费者已经读完的位置
+            alignas(64) std::atomic<std::uint64_t> tail{ 0 };   //生产者已经 flush 的位置
+            alignas(64) std::uint64_t write = 0;                //生产者私有
+            std::uint64_t cached_head = 0;
+        };
+
+        struct RecordHeader {
+            std::uint32_t type;
+            std::uint32_t size;
+        };
+
+        static constexpr std::uint32_t no_type = 0xffffffff;   //环尾放不下时的填充记录
+
+    public:
+        class Port {
+        public:
+            Port(EventBridge& bridge, EventManager& events, Ring& out, Ring& in)
+                : bridge_(bridge), events_(events), out_(out), in_(in) {}
+
+            Port(const Port&) = delete;
+            Port& operator= (const Port&) = delete;
+
+            ~Port() {
+                for (auto &forwarder : forwarders_) {
+                    forwarder->detach(events_);
+                }
+            }
+
+            //环满时返回 false 并计入 overflows, 可以先 flush 等对面 pump 后重发
+            template <typename Event>
+            bool send(const Event& event) {
+                static_assert(std::is_trivially_copyable<Event>::value, "bridged events must be trivially copyable");
+                auto type = bridge_family::type<Event>();
+                assert(type < bridge_.deliver_.size() && bridge_.deliver_[type] && "EventBridge::route() not called");
+                if (!bridge_.write_(out_, static_cast<std::uint32_t>(type), &event, sizeof(Event))) {
+                    ++overflows_;
+                    return false;
+                }
+                return true;
+            }
+
+            //把本地 emit 的 Event 自动 send 到对面
+            template <typename Event>
+            void forward() {
+                auto forwarder = new Forwarder<Event>(*this);
+                forwarders_.emplace_back(forwarder);
+                events_.subscribe<Event>(*forwarder);
+            }
+
+            void flush() {
+                out_.tail.store(out_.write, std::memory_order_release);
+            }
+
+            //先 flush 本端, 再派发对面已经 flush 的事件, 返回派发的个数
+            std::size_t pump() {
+                flush();
+                return bridge_.read_(in_, events_);
+            }
+
+            std::uint64_t overflows() const {
+                return overflows_;
+            }
+
+        private:
+            struct BaseForwarder {
+                virtual ~BaseForwarder() = default;
+                virtual void detach(EventManager& events) = 0;
+            };
+
+            template <typename Event>
+            struct Forwarder : BaseForwarder {
+                Forwarder(Port& port) : port(port) {}
+
+                void receive(const Event& event) {
+                    port.send(event);
+                }
+
+                void detach(EventManager& events) override {
+                    events.unsubscribe<Event>(*this);
+                }
+
+                Port& port;
+            };
+
+            EventBridge& bridge_;
+            EventManager& events_;
+            Ring& out_;
+            Ring& in_;
+            std::vector<std::unique_ptr<BaseForwarder>> forwarders_;
+            std::uint64_t overflows_ = 0;
+        };
+
+        //capacity 是每个方向的字节数, 向上取 2 的幂
+        EventBridge(EventManager& first, EventManager& second, std::size_t capacity = 1 << 16)
+            : first_to_second_(ceil_capacity_(capacity)), second_to_first_(ceil_capacity_(capacity)),
+            first_(*this, first, first_to_second_, second_to_first_),
+            second_(*this, second, second_to_first_, first_to_second_) {}
+
+        EventBridge(const EventBridge&) = delete;
+        EventBridge& operator= (const EventBridge&) = delete;
+
+        template <typename Event>
+        void route() {
+            static_assert(std::is_trivially_copyable<Event>::value, "bridged events must be trivially copyable");
+            assert(record_size_(sizeof(Event)) <= first_to_second_.buffer.size() * sizeof(std::uint64_t));
+            auto type = bridge_family::type<Event>();
+            if (!(type < deliver_.size())) {
+                deliver_.resize(type + 1, nullptr);
+            }
+            deliver_[type] = &EventBridge::deliver_event_<Event>;
+        }
+
+        Port& first() {
+            return first_;
+        }
+
+        Port& second() {
+            return second_;
+        }
+
+    private:
+        using bridge_family = Family<struct BridgeFamily>;
+
+        static std::size_t ceil_capacity_(std::size_t capacity) {
+            std::size_t size = 64;
+            while (size < capacity) {
+                size <<= 1;
+            }
+            return size;
+        }
+
+        static std::size_t record_size_(std::size_t size) {
+            return sizeof(RecordHeader) + (size + 7) / 8 * 8;
+        }
+
+        template <typename Event>
+        static void deliver_event_(EventManager& events, const unsigned char* data) {
+            typename std::aligned_storage<sizeof(Event), alignof(Event)>::type storage;
+            std::memcpy(&storage, data, sizeof(Event));
+            events.emit<Event>(*reinterpret_cast<const Event*>(&storage));
+        }
+
+        //记录按 8 字节对齐, 放不下时在环尾写一条填充记录再从头写
+        bool write_(Ring& ring, std::uint32_t type, const void* data, std::size_t size) {
+            std::size_t capacity = ring.buffer.size() * sizeof(std::uint64_t);
+            std::size_t bytes = record_size_(size);
+            std::size_t offset = static_cast<std::size_t>(ring.write & (capacity - 1));
+            std::size_t padding = capacity - offset < bytes ? capacity - offset : 0;
+            if (ring.write + padding + bytes - ring.cached_head > capacity) {
+                ring.cached_head = ring.head.load(std::memory_order_acquire);
+                if (ring.write + padding + bytes - ring.cached_head > capacity) {
+                    return false;
+                }
+            }
+            auto base = reinterpret_cast<unsigned char*>(ring.buffer.data());
+            if (padding) {
+                RecordHeader header{ no_type, 0 };
+                std::memcpy(base + offset, &header, sizeof(header));
+                ring.write += padding;
+                offset = 0;
+            }
+            RecordHeader header{ type, static_cast<std::uint32_t>(size) };
+            std::memcpy(base + offset, &header, sizeof(header));
+            std::memcpy(base + offset + sizeof(header), data, size);
+            ring.write += bytes;
+            return true;
+        }
+
+        std::size_t read_(Ring& ring, EventManager& events) {
+            std::size_t capacity = ring.buffer.size() * sizeof(std::uint64_t);
+            auto base = reinterpret_cast<const unsigned char*>(ring.buffer.data());
+            std::uint64_t head = ring.head.load(std::memory_order_relaxed);
+            std::uint64_t tail = ring.tail.load(std::memory_order_acquire);
+            std::size_t count = 0;
+            while (head != tail) {
+                std::size_t offset = static_cast<std::size_t>(head & (capacity - 1));
+                RecordHeader header;
+                std::memcpy(&header, base + offset, sizeof(header));
+                if (header.type == no_type) {
+                    head += capacity - offset;
+                    continue;
+                }
+                deliver_[header.type](events, base + offset + sizeof(header));
+                head += record_size_(header.size);
+                ++count;
+            }
+            ring.head.store(head, std::memory_order_release);
+            return count;
+        }
+
+        Ring first_to_second_;
+        Ring second_to_first_;
+        std::vector<void(*)(EventManager&, const unsigned char*)> deliver_;
+        Port first_;
+        Port second_;
+    };
+    class EntityManager :public DefaultRegistry
+    {
+        using view_type = SparseSet<std::uint32_t>;
+        using iterator_type = typename view_type::iterator_type;
+        class EntityIter
+        {
+        public:
+            EntityIter(EntityManager& entityManager, iterator_type& iter)
+                : iter_(iter)
+                , entity_manager_(entityManager) {
+            }
+            bool operator!= (const EntityIter& other) const
+            {
+                bool b = (iter_ != other.iter_);
+                return b;
+            }
+            Entity operator* () const {
+                return entity_manager_.getEntity(*iter_);
+            };
+            const EntityIter& operator++ ()
+            {
+                ++iter_;
+                return *this;
+            }
+        private:
+            iterator_type iter_;
+            EntityManager& entity_manager_;
         };
 
         template<typename En, typename ... Components>
@@ -217,7 +1681,7 @@ namespace entt {
         public:
             EntityViewMulti(EntityManager& entityManager) noexcept
                 : entity_manager_(entityManager),
-                _views(entityManager.view<Components ...>(entt::persistent_t{}))
+                _views((entityManager.thaw_all<Components ...>(), entityManager.view<Components ...>(entt::persistent_t{})))
             {
             }
             EntityIter begin() {
@@ -235,7 +1699,7 @@ namespace entt {
         public:
             EntityViewSingle(EntityManager& entityManager) noexcept
                 : entity_manager_(entityManager),
-                _views(entityManager.view<Component>())
+                _views((entityManager.thaw_all<Component>(), entityManager.view<Component>()))
             {
             }
             EntityIter begin() {
@@ -270,6 +1734,7 @@ namespace entt {
                 const EntityComponentIterMulti& operator++ ()
                 {
                     ++iter_;
+                    views_.prefetch_ahead(iter_);
                     return *this;
                 }
             private:
@@ -279,10 +1744,14 @@ namespace entt {
         public:
             EntityComponentViewMulti(EntityManager& entityManager, ComponentHandle<Components> & ... handles) noexcept
                 : entity_manager_(entityManager),
-                _views(entityManager.view<Components ...>(entt::persistent_t{})),
+                _views((entityManager.thaw_all<Components ...>(), entityManager.view<Components ...>(entt::persistent_t{}))),
                 handles(std::tuple<ComponentHandle<Components> & ...>(handles...)) {
             }
             EntityComponentIterMulti begin() {
+                auto warmup = std::min<std::size_t>(prefetch_distance_, _views.size());
+                for (std::size_t i = 0; i < warmup; ++i) {
+                    entity_manager_.prefetch_components<Components...>(*(_views.begin() + i));
+                }
                 return EntityComponentIterMulti(_views.begin(), *this);
             }
             EntityComponentIterMulti end() {
@@ -307,9 +1776,25 @@ namespace entt {
                 unpack(entity);
                 return entity;
             }
+
+            //返回一个迭代时预取的视图: 提前 distance 个实体取出组件地址并预取, 0 表示关闭
+            EntityComponentViewMulti prefetch(std::size_t distance = 8) const {
+                EntityComponentViewMulti view(*this);
+                view.prefetch_distance_ = distance;
+                return view;
+            }
+            void prefetch_ahead(iterator_type iter) const {
+                if (prefetch_distance_) {
+                    std::size_t remaining = _views.end() - iter;
+                    if (remaining > prefetch_distance_) {
+                        entity_manager_.prefetch_components<Components...>(*(iter + prefetch_distance_));
+                    }
+                }
+            }
             PersistentView<En, Components...>  _views;
             EntityManager& entity_manager_;
             std::tuple<ComponentHandle<Components> & ...> handles;
+            std::size_t prefetch_distance_ = 0;
         };
 
         template<typename En, typename ... Components>
@@ -334,6 +1819,7 @@ namespace entt {
                 const EntityComponentIterSingle& operator++ ()
                 {
                     ++iter_;
+                    views_.prefetch_ahead(iter_);
                     return *this;
                 }
             private:
@@ -343,10 +1829,14 @@ namespace entt {
         public:
             EntityComponentViewSingle(EntityManager& entityManager, ComponentHandle<Components> & ... handles) noexcept
                 : entity_manager_(entityManager),
-                _views(entityManager.view<Components ...>()),
+                _views((entityManager.thaw_all<Components ...>(), entityManager.view<Components ...>())),
                 handles(std::tuple<ComponentHandle<Components> & ...>(handles...)) {
             }
             EntityComponentIterSingle begin() {
+                auto warmup = std::min<std::size_t>(prefetch_distance_, _views.size());
+                for (std::size_t i = 0; i < warmup; ++i) {
+                    entity_manager_.prefetch_components<Components...>(*(_views.begin() + i));
+                }
                 return EntityComponentIterSingle(_views.begin(), *this);
             }
             EntityComponentIterSingle end() {
@@ -369,15 +1859,67 @@ namespace entt {
                 unpack(entity);
                 return entity;
             }
+
+            //返回一个迭代时预取的视图: 提前 distance 个实体取出组件地址并预取, 0 表示关闭
+            EntityComponentViewSingle prefetch(std::size_t distance = 8) const {
+                EntityComponentViewSingle view(*this);
+                view.prefetch_distance_ = distance;
+                return view;
+            }
+            void prefetch_ahead(iterator_type iter) const {
+                if (prefetch_distance_) {
+                    std::size_t remaining = _views.end() - iter;
+                    if (remaining > prefetch_distance_) {
+                        entity_manager_.prefetch_components<Components...>(*(iter + prefetch_distance_));
+                    }
+                }
+            }
             View<En, Components...>  _views;
             EntityManager& entity_manager_;
             std::tuple<ComponentHandle<Components> & ...> handles;
+            std::size_t prefetch_distance_ = 0;
         };
     public:
         Entity createEntity() {
             entity_type entity = DefaultRegistry::create();
+            if (journal_) {
+                journal_->append(Journal::Create, entity);
+            }
+            created_.push_back(entity);
             return getEntity(entity);
         };
+
+        void destroy(entity_type entity) {
+            if (!hibernated_.empty()) {
+                hibernated_.erase(entity);
+            }
+            //冷数据先放回池里, 销毁时照常发移除事件、计数, 压缩页里也不留下死记录
+            for (auto& pool : cold_pools_) {
+                if (pool) {
+                    pool->thaw_entity(*this, entity);
+                }
+            }
+            DefaultRegistry::destroy(entity);
+            if (journal_) {
+                journal_->append(Journal::Destroy, entity);
+            }
+            destroyed_.push_back(entity);
+        }
+
+        //派发自上次 flush 以来的 EntitiesCreated/EntitiesDestroyed, 各一次; SystemManager::update_all 结束时会调用
+        void flush_lifecycle() {
+            created_.swap(flushing_created_);
+            destroyed_.swap(flushing_destroyed_);
+            if (!flushing_created_.empty()) {
+                event_manager_.emit<EntitiesCreated>(flushing_created_.data(), flushing_created_.size());
+            }
+            if (!flushing_destroyed_.empty()) {
+                event_manager_.emit<EntitiesDestroyed>(flushing_destroyed_.data(), flushing_destroyed_.size());
+            }
+            flushing_created_.clear();
+            flushing_destroyed_.clear();
+            spatial_dirty_ = true;
+        }
 
         Entity getEntity(entity_type entity) {
 
@@ -417,29 +1959,47 @@ namespace entt {
 
         template<typename Component>
         void receiveAddComponent(DefaultRegistry & entityManager, entity_type entity) {
+            if (storage_moving_) {
+                return;
+            }
+            if (deferring_events_) {
+                pending_events_.push_back([this, entity]() {
+                    event_manager_.emit<ComponentAddedEvent<Component>>(getEntity(entity), ComponentHandle<Component>(this, entity));
+                });
+                return;
+            }
             event_manager_.emit<ComponentAddedEvent<Component>>(getEntity(entity), ComponentHandle<Component>(this, entity));
         }
 
         template<typename Component>
         void receiveRemoveComponent(DefaultRegistry & entityManager, entity_type entity) {
+            if (storage_moving_) {
+                return;
+            }
+            if (deferring_events_) {
+                pending_events_.push_back([this, entity]() {
+                    event_manager_.emit<ComponentRemovedEvent<Component>>(getEntity(entity), ComponentHandle<Component>(this, entity));
+                });
+                return;
+            }
             event_manager_.emit<ComponentRemovedEvent<Component>>(getEntity(entity), ComponentHandle<Component>(this, entity));
         }
 
         template <typename Event, typename Receiver>
         std::enable_if_t<std::is_same<typename Event, ComponentAddedEvent<typename Event::ComponentType>>::value>
-            subscribe(Receiver& receiver)
+            subscribe(Receiver& receiver, int priority = 0)
         {
             using ComponentType = Event::ComponentType;
-            event_manager_.subscribe<Event>(receiver);
+            event_manager_.subscribe<Event>(receiver, priority);
             construction<ComponentType>().connect<EntityManager, &EntityManager::receiveAddComponent<ComponentType>>(this);
         }
 
         template <typename Event, typename Receiver>
         std::enable_if_t<std::is_same<typename Event, ComponentRemovedEvent<typename Event::ComponentType>>::value>
-            subscribe(Receiver& receiver)
+            subscribe(Receiver& receiver, int priority = 0)
         {
             using ComponentType = Event::ComponentType;
-            event_manager_.subscribe<Event>(receiver);
+            event_manager_.subscribe<Event>(receiver, priority);
             destruction<ComponentType>().connect<EntityManager, &EntityManager::receiveRemoveComponent<ComponentType>>(this);
         }
 
@@ -457,51 +2017,2186 @@ namespace entt {
             unsubscribe(Receiver& receiver)
         {
             using ComponentType = Event::ComponentType;
-            event_manager_.subscribe<Event>(receiver);
+            event_manager_.unsubscribe<Event>(receiver);
             destruction<ComponentType>().disconnect<EntityManager, &EntityManager::receiveRemoveComponent<ComponentType>>(this);
-        }
-
-        EntityManager(EventManager& events) :event_manager_(events) {}
-        EventManager &event_manager_;
-        std::vector<Entity> entityWrappers;
-    };
-
-    class BaseSystem : public entt::Family<struct SystemFamily> {
-    public:
-        typedef size_t Family;
+        }
 
-        virtual ~BaseSystem() {};
+        //---------------------------预取--------------------------
+        //视图的预取模式: 提前几个实体经 EnTT 的稀疏数组取出组件地址(就是句柄之后解引用的地址)并预取组件本身
+        //查稀疏数组的读取和当前实体的计算重叠, 不另外维护下标表, 添加/删除组件没有额外开销
+        //和 EnTT 的视图一样, 遍历中只能移除当前实体的组件
+        template <typename ... Components>
+        void prefetch_components(entity_type entity) {
+            using accumulator_type = int[];
+            accumulator_type accumulator = { 0, (prefetch_component_<Components>(entity), 0)... };
+            (void)accumulator;
+        }
 
-        virtual void configure(EntityManager &entities, EventManager &events) {
-            configure(events);
+        //---------------------------冷存储--------------------------
+        //按实体下标每 256 个分一页; 一页里的组件连续 idle_frames 帧没有通过句柄访问时, 从池里移出并压缩
+        //ComponentHandle/Entity、replace/write、journal_write、事务和 resolve/gather/scatter 访问到冷数据时整页解压放回池里
+        //视图构造和 sort/respect 会解压它涉及的类型; 直接调用 DefaultRegistry 的 has/get 看不到冷数据
+        //has_component/ComponentHandle::valid 用 contains 查冷索引, 不解压; destroy 先解压实体所在的页, 移除事件照常发出
+        //移入移出不会触发组件事件和日志; 只支持可平凡拷贝的组件
+        template <typename Component>
+        void enable_cold_storage() {
+            static_assert(std::is_trivially_copyable<Component>::value, "cold components must be trivially copyable");
+            auto family = cold_family::type<Component>();
+            if (!(family < cold_pools_.size())) {
+                cold_pools_.resize(family + 1);
+            }
+            if (!cold_pools_[family]) {
+                cold_pools_[family].reset(new ColdPool<Component>());
+            }
         }
-        virtual void configure(EventManager &events) {}
-        virtual void update(EntityManager &entities, EventManager &events, TimeDelta dt) = 0;
-    };
-
-    class SystemManager {
-    public:
-        SystemManager(EntityManager &entity_manager,
-            EventManager &event_manager) :
-            entity_manager_(entity_manager),
-            event_manager_(event_manager) {}
 
-        template <typename System>
-        void add(std::shared_ptr<System> system) {
-            systems_.insert(std::make_pair(System::type<System>(), system));
+        //每帧(或每隔几帧)调用一次, 扫描登记过的池压缩闲置的页
+        void update_cold_storage(std::uint32_t idle_frames) {
+            assert(!transaction_open_);
+            ++cold_frame_;
+            for (auto& pool : cold_pools_) {
+                if (pool) {
+                    pool->compress(*this, idle_frames);
+                }
+            }
         }
 
-        template <typename System, typename ... Args>
-        std::shared_ptr<System> add(Args && ... args) {
-            std::shared_ptr<System> s(new System(std::forward<Args>(args) ...));
-            add(s);
-            return s;
+        //解压这些类型的所有冷页, 并记下它们在本帧被视图使用
+        template <typename ... Components>
+        void thaw_all() {
+            if (!cold_pools_.empty()) {
+                using accumulator_type = int[];
+                accumulator_type accumulator = { 0, (thaw_all_<Components>(), 0)... };
+                (void)accumulator;
+            }
         }
 
-        template <typename System>
-        std::shared_ptr<System> system() {
-            auto it = systems_.find(System::type<System>());
-            assert(it != systems_.end());
+        //实体有没有这个组件, 冷数据也算; 只查索引, 不解压也不算访问
+        template <typename Component>
+        bool contains(entity_type entity) const {
+            if (has<Component>(entity)) {
+                return true;
+            }
+            auto family = cold_family::type<Component>();
+            return family < cold_pools_.size() && cold_pools_[family] && cold_pools_[family]->holds(entity);
+        }
+
+        //确保实体的组件在池里, 返回实体是否有这个组件
+        template <typename Component>
+        bool thaw(entity_type entity) {
+            if (has<Component>(entity)) {
+                return true;
+            }
+            auto pool = cold_pool_<Component>();
+            return pool && pool->thaw(*this, entity) && has<Component>(entity);
+        }
+
+        //句柄访问组件的入口: 记录访问并在需要时解压
+        template <typename Component>
+        Component& fetch(entity_type entity) {
+            if (!cold_pools_.empty()) {
+                if (auto pool = cold_pool_<Component>()) {
+                    pool->touch(entity, cold_frame_);
+                    if (!has<Component>(entity)) {
+                        pool->thaw(*this, entity);
+                    }
+                }
+            }
+            return get<Component>(entity);
+        }
+
+        ColdStats cold_stats() const {
+            ColdStats stats;
+            for (auto& pool : cold_pools_) {
+                if (pool) {
+                    stats.pages += pool->stats.pages;
+                    stats.entities += pool->stats.entities;
+                    stats.raw_bytes += pool->stats.raw_bytes;
+                    stats.compressed_bytes += pool->stats.compressed_bytes;
+                }
+            }
+            return stats;
+        }
+
+        //---------------------------休眠--------------------------
+        //把实体身上登记过的组件写到磁盘并从池里移除, 实体 ID 保持有效, 内存里只留一条索引
+        //wake 读回组件, ID 不变; 移入移出不会触发组件事件和日志; 只支持可平凡拷贝的组件
+        void set_hibernation_store(HibernationStore* store) {
+            hibernation_store_ = store;
+        }
+
+        template <typename Component>
+        void hibernate_component() {
+            static_assert(std::is_trivially_copyable<Component>::value, "hibernated components must be trivially copyable");
+            auto family = hibernation_family::type<Component>();
+            if (!(family < hibernation_ids_.size())) {
+                hibernation_ids_.resize(family + 1, std::uint32_t(no_type));
+            }
+            if (hibernation_ids_[family] == no_type) {
+                hibernation_ids_[family] = std::uint32_t(hibernation_types_.size());
+                hibernation_types_.push_back({ &EntityManager::hibernate_save_<Component>, &EntityManager::hibernate_remove_<Component>, &EntityManager::hibernate_restore_<Component>, std::uint32_t(sizeof(Component)) });
+            }
+        }
+
+        //整批实体写成一次追加, 写盘成功后才从池里移除组件; 返回实际休眠的数量, 写盘失败时为 0, 实体保持原样
+        std::size_t hibernate(const entity_type* entities, std::size_t count) {
+            assert(hibernation_store_ && "set_hibernation_store() not called");
+            assert(!transaction_open_);
+            std::vector<unsigned char> buffer;
+            std::vector<std::pair<entity_type, HibernationSlot>> slots;
+            storage_moving_ = true;
+            for (std::size_t i = 0; i < count; ++i) {
+                entity_type entity = entities[i];
+                if (!valid(entity) || hibernated_.count(entity)) {
+                    continue;
+                }
+                std::size_t begin = buffer.size();
+                buffer.resize(begin + sizeof(std::uint32_t));
+                std::uint32_t components = 0;
+                for (std::uint32_t type = 0; type < hibernation_types_.size(); ++type) {
+                    if (hibernation_types_[type].save(*this, entity, type, buffer)) {
+                        ++components;
+                    }
+                }
+                std::memcpy(buffer.data() + begin, &components, sizeof(components));
+                slots.push_back({ entity, { begin, std::uint32_t(buffer.size() - begin) } });
+            }
+            storage_moving_ = false;
+
+            std::uint64_t base;
+            if (slots.empty() || !hibernation_store_->append(buffer.data(), buffer.size(), base)) {
+                return 0;
+            }
+            storage_moving_ = true;
+            for (auto& slot : slots) {
+                for (auto& type : hibernation_types_) {
+                    type.remove(*this, slot.first);
+                }
+                slot.second.offset += base;
+                hibernated_.insert(slot);
+            }
+            storage_moving_ = false;
+            return slots.size();
+        }
+
+        std::size_t hibernate(const std::vector<entity_type>& entities) {
+            return hibernate(entities.data(), entities.size());
+        }
+
+        bool wake(entity_type entity) {
+            return wake(&entity, 1) == 1;
+        }
+
+        //按文件偏移排序后顺序读回; 返回实际唤醒的数量
+        //读失败的实体仍然处于休眠状态, 不计入返回值, 可以稍后重试
+        std::size_t wake(const entity_type* entities, std::size_t count) {
+            assert(hibernation_store_ && "set_hibernation_store() not called");
+            std::vector<std::pair<HibernationSlot, entity_type>> pending;
+            for (std::size_t i = 0; i < count; ++i) {
+                auto it = hibernated_.find(entities[i]);
+                if (it != hibernated_.end()) {
+                    pending.push_back({ it->second, it->first });
+                }
+            }
+            std::sort(pending.begin(), pending.end(), [](const std::pair<HibernationSlot, entity_type>& lhs, const std::pair<HibernationSlot, entity_type>& rhs) {
+                return lhs.first.offset < rhs.first.offset;
+            });
+
+            std::size_t woken = 0;
+            std::vector<unsigned char> buffer;
+            storage_moving_ = true;
+            for (auto& item : pending) {
+                buffer.resize(item.first.size);
+                if (!hibernation_store_->read(item.first.offset, buffer.size(), buffer.data())) {
+                    continue;
+                }
+                hibernated_.erase(item.second);
+                std::uint32_t components;
+                std::memcpy(&components, buffer.data(), sizeof(components));
+                std::size_t offset = sizeof(components);
+                for (std::uint32_t i = 0; i < components; ++i) {
+                    std::uint32_t header[2];
+                    std::memcpy(header, buffer.data() + offset, sizeof(header));
+                    offset += sizeof(header);
+                    if (header[0] < hibernation_types_.size() && hibernation_types_[header[0]].size == header[1]) {
+                        hibernation_types_[header[0]].restore(*this, item.second, buffer.data() + offset);
+                    }
+                    offset += header[1];
+                }
+                ++woken;
+            }
+            storage_moving_ = false;
+            return woken;
+        }
+
+        std::size_t wake(const std::vector<entity_type>& entities) {
+            return wake(entities.data(), entities.size());
+        }
+
+        bool is_hibernating(entity_type entity) const {
+            return hibernated_.count(entity) != 0;
+        }
+
+        std::size_t hibernating() const {
+            return hibernated_.size();
+        }
+
+        //---------------------------日志--------------------------
+        //挂上日志后, createEntity/destroy、登记类型的 assign/remove/replace 和 journal_write 都会追加记录
+        void set_journal(Journal* journal) {
+            journal_ = journal;
+        }
+
+        //登记一个要写进日志的组件类型; 恢复时必须按同样的顺序登记
+        template <typename Component>
+        void journal_component() {
+            static_assert(std::is_trivially_copyable<Component>::value, "journaled components must be trivially copyable");
+            auto family = journal_family::type<Component>();
+            if (!(family < journal_ids_.size())) {
+                journal_ids_.resize(family + 1, std::uint32_t(no_type));
+            }
+            if (journal_ids_[family] != no_type) {
+                return;
+            }
+            journal_ids_[family] = std::uint32_t(journal_types_.size());
+            journal_types_.push_back({ &EntityManager::replay_write_<Component>, &EntityManager::replay_remove_<Component>, std::uint32_t(sizeof(Component)) });
+            construction<Component>().connect<EntityManager, &EntityManager::journalAddComponent<Component>>(this);
+            destruction<Component>().connect<EntityManager, &EntityManager::journalRemoveComponent<Component>>(this);
+        }
+
+        //组件被原地修改后调用, 把当前值写进日志
+        template <typename Component>
+        void journal_write(entity_type entity) {
+            if (journal_ && journaled_<Component>()) {
+                journal_->append(Journal::Write, entity, journal_ids_[journal_family::type<Component>()], &fetch<Component>(entity), sizeof(Component));
+            }
+        }
+
+        template <typename Component, typename ... Args>
+        Component& replace(entity_type entity, Args && ... args) {
+            fetch<Component>(entity);
+            Component& component = DefaultRegistry::replace<Component>(entity, std::forward<Args>(args) ...);
+            journal_write<Component>(entity);
+            mark_changed<Component>();
+            mark_buffered_<Component>(entity);
+            return component;
+        }
+
+        //在刚载入的快照上重放日志; 文件整体读入内存后顺序应用, 末尾不完整的记录(崩溃时没写完)被忽略
+        //重放期间不会再写日志; generation 返回日志头里的代号
+        bool replay_journal(const std::string& path, std::uint64_t* generation = nullptr) {
+            std::FILE* file = std::fopen(path.c_str(), "rb");
+            if (!file) {
+                return false;
+            }
+            std::vector<unsigned char> data;
+            unsigned char chunk[1 << 16];
+            for (std::size_t read; (read = std::fread(chunk, 1, sizeof(chunk), file)) > 0;) {
+                data.insert(data.end(), chunk, chunk + read);
+            }
+            std::fclose(file);
+
+            std::uint32_t magic = 0;
+            std::uint64_t journal_generation = 0;
+            std::size_t offset = sizeof(magic) + sizeof(journal_generation);
+            if (data.size() < offset) {
+                return false;
+            }
+            std::memcpy(&magic, data.data(), sizeof(magic));
+            std::memcpy(&journal_generation, data.data() + sizeof(magic), sizeof(journal_generation));
+            if (magic != Journal::MAGIC) {
+                return false;
+            }
+            if (generation) {
+                *generation = journal_generation;
+            }
+
+            Journal* journal = journal_;
+            journal_ = nullptr;
+            //快照恢复了空闲列表时 create 会得到同样的 ID, 对不上时通过 remap 转换
+            std::unordered_map<entity_type, entity_type> remap;
+            auto local = [&remap](entity_type entity) {
+                if (remap.empty()) {
+                    return entity;
+                }
+                auto it = remap.find(entity);
+                return it == remap.end() ? entity : it->second;
+            };
+
+            Journal::RecordHeader header;
+            while (offset + sizeof(header) <= data.size()) {
+                std::memcpy(&header, data.data() + offset, sizeof(header));
+                if (offset + sizeof(header) + header.size > data.size()) {
+                    break;
+                }
+                const unsigned char* payload = data.data() + offset + sizeof(header);
+                offset += sizeof(header) + header.size;
+
+                entity_type entity = local(header.entity);
+                switch (header.op) {
+                case Journal::Create: {
+                    entity_type created = DefaultRegistry::create();
+                    if (created != header.entity) {
+                        remap[header.entity] = created;
+                    }
+                    break;
+                }
+                case Journal::Destroy:
+                    if (valid(entity)) {
+                        DefaultRegistry::destroy(entity);
+                    }
+                    remap.erase(header.entity);
+                    break;
+                case Journal::Write:
+                    if (header.type < journal_types_.size() && journal_types_[header.type].size == header.size && valid(entity)) {
+                        journal_types_[header.type].write(*this, entity, payload);
+                    }
+                    break;
+                case Journal::Remove:
+                    if (header.type < journal_types_.size() && valid(entity)) {
+                        journal_types_[header.type].remove(*this, entity);
+                    }
+                    break;
+                default:
+                    offset = data.size();
+                    break;
+                }
+            }
+            journal_ = journal;
+            return true;
+        }
+
+        //---------------------------事务--------------------------
+        //事务内的结构修改和组件写入记到撤销日志里, commit 之前这些操作的组件事件只排队不派发
+        //事务打开期间绕过 Transaction 直接修改的不属于事务, 事件照常立即派发, 回滚也不撤销
+        //remove 和 destroy 推迟到 commit 时执行, 回滚不需要恢复组件, 提交时的移除事件也和事务外一样能读到组件
+        //所以事务里 remove 之后 has 仍然为真, 也不能再 assign 同一种组件
+        //同一时间只能有一个事务; 析构时没有 commit 的事务自动回滚
+        class Transaction {
+        public:
+            Transaction(EntityManager& manager) : manager_(&manager) {
+                assert(!manager_->transaction_open_ && "nested transactions are not supported");
+                manager_->transaction_open_ = true;
+                if (manager_->journal_) {
+                    manager_->journal_->hold();
+                }
+            }
+
+            Transaction(Transaction&& other) : manager_(other.manager_) {
+                other.manager_ = nullptr;
+            }
+
+            Transaction(const Transaction&) = delete;
+            Transaction& operator= (const Transaction&) = delete;
+
+            ~Transaction() {
+                if (manager_) {
+                    rollback();
+                }
+            }
+
+            Entity create() {
+                assert(manager_);
+                Entity entity = manager_->createEntity();
+                manager_->undo_log_.push_back({ &EntityManager::undo_create_, entity.id(), 0, nullptr });
+                return entity;
+            }
+
+            void destroy(Entity entity) {
+                assert(manager_);
+                manager_->doomed_.push_back(entity.id());
+            }
+
+            template <typename Component, typename ... Args>
+            ComponentHandle<Component> assign(Entity entity, Args && ... args) {
+                assert(manager_);
+                manager_->deferring_events_ = true;
+                manager_->DefaultRegistry::assign<Component>(entity.id(), std::forward<Args>(args) ...);
+                manager_->deferring_events_ = false;
+                manager_->undo_log_.push_back({ &EntityManager::undo_assign_<Component>, entity.id(), 0, nullptr });
+                return ComponentHandle<Component>(manager_, entity.id());
+            }
+
+            template <typename Component>
+            void remove(Entity entity) {
+                assert(manager_);
+                manager_->doomed_components_.push_back({ &EntityManager::remove_doomed_<Component>, entity.id() });
+            }
+
+            template <typename Component, typename ... Args>
+            ComponentHandle<Component> replace(Entity entity, Args && ... args) {
+                assert(manager_);
+                manager_->journal_value_<Component>(entity.id());
+                manager_->DefaultRegistry::replace<Component>(entity.id(), std::forward<Args>(args) ...);
+                manager_->mark_changed<Component>();
+                manager_->mark_buffered_<Component>(entity.id());
+                return ComponentHandle<Component>(manager_, entity.id());
+            }
+
+            //先记录旧值再返回可写引用
+            template <typename Component>
+            Component& write(Entity entity) {
+                assert(manager_);
+                manager_->journal_value_<Component>(entity.id());
+                manager_->mark_changed<Component>();
+                manager_->mark_buffered_<Component>(entity.id());
+                return manager_->fetch<Component>(entity.id());
+            }
+
+            void commit() {
+                assert(manager_);
+                EntityManager& manager = *manager_;
+                manager_ = nullptr;
+                for (auto& record : manager.undo_log_) {
+                    record.undo(manager, record, false);
+                }
+                std::vector<std::function<void()>> pending;
+                pending.swap(manager.pending_events_);
+                std::vector<DoomedComponent> removes;
+                removes.swap(manager.doomed_components_);
+                std::vector<entity_type> doomed;
+                doomed.swap(manager.doomed_);
+                if (manager.journal_) {
+                    manager.journal_->release();
+                }
+                manager.close_transaction_();
+
+                for (auto& emit : pending) {
+                    emit();
+                }
+                //事务已经关闭, 移除事件在组件移除之前同步派发
+                for (auto& remove : removes) {
+                    remove.remove(manager, remove.entity);
+                }
+                for (auto entity : doomed) {
+                    if (manager.valid(entity)) {
+                        manager.destroy(entity);
+                    }
+                }
+            }
+
+            void rollback() {
+                assert(manager_);
+                EntityManager& manager = *manager_;
+                manager_ = nullptr;
+                //撤销产生的事件和被撤销操作排队的事件一起丢掉
+                manager.deferring_events_ = true;
+                for (auto it = manager.undo_log_.rbegin(); it != manager.undo_log_.rend(); ++it) {
+                    it->undo(manager, *it, true);
+                }
+                manager.deferring_events_ = false;
+                if (manager.journal_) {
+                    manager.journal_->discard();
+                }
+                manager.pending_events_.clear();
+                manager.close_transaction_();
+            }
+
+        private:
+            EntityManager* manager_;
+        };
+
+        Transaction transaction() {
+            return Transaction(*this);
+        }
+
+        //---------------------------排序--------------------------
+        //按组件排序, 池较大时并行; 排的是下标数组, 组件最后按置换一次到位
+        template <typename Component, typename Compare>
+        void sort(Compare compare) {
+            thaw_all<Component>();
+            DefaultRegistry::sort<Component>(std::move(compare), ParallelSort{});
+        }
+
+        template <typename Component, typename Compare, typename Sort, typename ... Args>
+        void sort(Compare compare, Sort sort, Args && ... args) {
+            thaw_all<Component>();
+            DefaultRegistry::sort<Component>(std::move(compare), std::move(sort), std::forward<Args>(args) ...);
+        }
+
+        template <typename To, typename From>
+        void sort() {
+            thaw_all<To, From>();
+            DefaultRegistry::sort<To, From>();
+        }
+
+        //让 To 的遍历顺序跟随 From: 共有的实体按 From 的顺序排在前面, 其余保持原来的相对顺序
+        //名次并行计算, 再用 ParallelSort 排一次
+        template <typename To, typename From>
+        void respect() {
+            thaw_all<To, From>();
+            auto from = view<From>();
+            auto to = view<To>();
+            std::size_t from_size = from.size();
+            std::size_t to_size = to.size();
+            const entity_type none = ~entity_type{};
+
+            std::vector<entity_type> from_rank(DefaultRegistry::size(), none);
+            parallel_for(from_size, ParallelSort::threshold, [&from, &from_rank](std::size_t begin, std::size_t end) {
+                for (auto i = begin; i < end; ++i) {
+                    from_rank[*(from.begin() + i) & traits_type::entity_mask] = entity_type(i);
+                }
+            });
+
+            //Registry::sort 把池内组件的引用交给比较函数, 用地址差换回稠密下标
+            const To* base = raw<To>();
+            std::vector<entity_type> rank(to_size);
+            parallel_for(to_size, ParallelSort::threshold, [&](std::size_t begin, std::size_t end) {
+                for (auto i = begin; i < end; ++i) {
+                    entity_type entity = *(to.begin() + i);
+                    entity_type shared = from_rank[entity & traits_type::entity_mask];
+                    rank[&get<To>(entity) - base] = shared != none ? shared : entity_type(from_size + i);
+                }
+            });
+
+            DefaultRegistry::sort<To>([&rank, base](const To& lhs, const To& rhs) {
+                return rank[&lhs - base] < rank[&rhs - base];
+            }, ParallelSort{});
+        }
+
+        //---------------------------批量解析--------------------------
+        //按实体下标排序后顺序探测稀疏数组, 同一页内的查找连续完成; out[i] 对应第 i 个输入, 失效的为 nullptr
+        template <typename Component>
+        void resolve(const ComponentHandle<Component>* handles, std::size_t count, Component** out) {
+            resolve_<Component>(count, out, [this, handles](std::size_t i, entity_type& entity) {
+                entity = handles[i].id_;
+                return handles[i].manager_ == this;
+            });
+        }
+
+        template <typename Component>
+        void resolve(const entity_type* entities, std::size_t count, Component** out) {
+            resolve_<Component>(count, out, [entities](std::size_t i, entity_type& entity) {
+                entity = entities[i];
+                return true;
+            });
+        }
+
+        template <typename Component>
+        void resolve(const std::vector<ComponentHandle<Component>>& handles, std::vector<Component*>& out) {
+            out.resize(handles.size());
+            resolve<Component>(handles.data(), handles.size(), out.data());
+        }
+
+        template <typename Component>
+        void resolve(const std::vector<entity_type>& entities, std::vector<Component*>& out) {
+            out.resize(entities.size());
+            resolve<Component>(entities.data(), entities.size(), out.data());
+        }
+
+        //---------------------------gather/scatter--------------------------
+        //把任意实体子集的组件拷到连续缓冲区(gather), 处理完再写回(scatter)
+        //没有该组件的实体被跳过, 对应的缓冲区元素保持不变; 返回实际拷贝的数量
+        template <typename Component>
+        std::size_t gather(const entity_type* entities, std::size_t count, Component* out) {
+            return transfer_<Component, false>(entities, count, out);
+        }
+
+        template <typename Component>
+        std::size_t scatter(const entity_type* entities, std::size_t count, const Component* in) {
+            return transfer_<Component, true>(entities, count, const_cast<Component*>(in));
+        }
+
+        template <typename Component>
+        std::size_t gather(const std::vector<entity_type>& entities, std::vector<Component>& out) {
+            out.resize(entities.size());
+            return gather<Component>(entities.data(), entities.size(), out.data());
+        }
+
+        template <typename Component>
+        std::size_t scatter(const std::vector<entity_type>& entities, const std::vector<Component>& in) {
+            assert(in.size() >= entities.size());
+            return scatter<Component>(entities.data(), entities.size(), in.data());
+        }
+
+        //---------------------------singleton--------------------------
+        //全局唯一的组件(时钟、物理参数、输入快照等),按类型下标直接访问,不经过稀疏集
+        template <typename Singleton, typename ... Args>
+        Singleton& set_singleton(Args && ... args) {
+            auto pos = singleton_family::type<Singleton>();
+            if (!(pos < singletons_.size())) {
+                singletons_.resize(pos + 1);
+            }
+            singletons_[pos] = std::make_shared<Singleton>(std::forward<Args>(args) ...);
+            Singleton& singleton = *static_cast<Singleton*>(singletons_[pos].get());
+            event_manager_.emit<SingletonChangedEvent<Singleton>>(singleton);
+            return singleton;
+        }
+
+        template <typename Singleton>
+        Singleton& singleton() {
+            assert(has_singleton<Singleton>());
+            return *static_cast<Singleton*>(singletons_[singleton_family::type<Singleton>()].get());
+        }
+
+        template <typename Singleton>
+        const Singleton& singleton() const {
+            assert(has_singleton<Singleton>());
+            return *static_cast<const Singleton*>(singletons_[singleton_family::type<Singleton>()].get());
+        }
+
+        template <typename Singleton>
+        bool has_singleton() const {
+            auto pos = singleton_family::type<Singleton>();
+            return pos < singletons_.size() && singletons_[pos];
+        }
+
+        template <typename Singleton>
+        void remove_singleton() {
+            if (has_singleton<Singleton>()) {
+                singletons_[singleton_family::type<Singleton>()].reset();
+                event_manager_.emit<SingletonRemovedEvent<Singleton>>();
+            }
+        }
+
+        //写入快照, 格式与 Snapshot::component 相同: 先写数量, 再写 (entity, value)
+        template <typename ... Singletons, typename Archive>
+        void snapshot_singletons(Archive &archive) const {
+            using accumulator_type = int[];
+            accumulator_type accumulator = { 0, (snapshot_singleton<Singletons>(archive), 0)... };
+            (void)accumulator;
+        }
+
+        template <typename ... Singletons, typename Archive>
+        void restore_singletons(Archive &archive) {
+            using accumulator_type = int[];
+            accumulator_type accumulator = { 0, (restore_singleton<Singletons>(archive), 0)... };
+            (void)accumulator;
+        }
+
+        //---------------------------变更计数--------------------------
+        //watch_changes 之后这种组件每次添加、删除、replace 或 mark_changed 计数加一, 返回的编号传给 change_version
+        //原地修改组件检测不到, 需要的话修改后调用 mark_changed; 冷存储和休眠搬动组件不计数
+        template <typename Component>
+        std::size_t watch_changes() {
+            auto family = change_family::type<Component>();
+            while (!(family < change_versions_.size())) {
+                change_versions_.emplace_back(std::uint64_t(no_version));
+            }
+            if (change_versions_[family] == no_version) {
+                change_versions_[family] = 0;
+                construction<Component>().connect<EntityManager, &EntityManager::countChange<Component>>(this);
+                destruction<Component>().connect<EntityManager, &EntityManager::countChange<Component>>(this);
+            }
+            return family;
+        }
+
+        template <typename Component>
+        void mark_changed() {
+            auto family = change_family::type<Component>();
+            if (family < change_versions_.size() && change_versions_[family] != no_version) {
+                ++change_versions_[family];
+            }
+        }
+
+        std::uint64_t change_version(std::size_t family) const {
+            return family < change_versions_.size() && change_versions_[family] != no_version ? change_versions_[family].load() : 0;
+        }
+
+        //---------------------------双缓冲--------------------------
+        //读邻居状态又写自己状态的系统(群聚、元胞模拟)用: previous 读上一帧的值, write 写本帧的值
+        //池里的组件就是本帧的值, 另存一份上一帧的值; swap_buffers 时只把本帧 write/mark_dirty 过的条目拷过去
+        //SystemManager::update_all 结束时调用 swap_buffers; 通过 get 直接改的值要 mark_dirty 才会同步
+        //write/mark_dirty 可以在 update_parallel 的多个任务里同时调用(包括写同一种组件); 并行写的组件不要放进冷存储
+        template <typename Component>
+        void double_buffer() {
+            auto family = buffer_family::type<Component>();
+            if (!(family < buffers_.size())) {
+                buffers_.resize(family + 1);
+            }
+            if (buffers_[family]) {
+                return;
+            }
+            auto buffer = new ComponentBuffer<Component>();
+            buffers_[family].reset(buffer);
+            auto count = size<Component>();
+            const Component* raw = this->raw<Component>();
+            const entity_type* entities = data<Component>();
+            for (std::size_t i = 0; i < count; ++i) {
+                buffer->store(entities[i], raw[i]);
+            }
+            construction<Component>().connect<EntityManager, &EntityManager::bufferAddComponent<Component>>(this);
+        }
+
+        //上一次 swap_buffers 时的值; 这之后才添加的组件返回添加时的值
+        template <typename Component>
+        const Component& previous(entity_type entity) const {
+            auto& buffer = buffer_<Component>();
+            auto index = entity & traits_type::entity_mask;
+            assert(index < buffer.previous.size() && "entity has no double-buffered component");
+            return buffer.previous[index];
+        }
+
+        template <typename Component>
+        Component& write(entity_type entity) {
+            buffer_<Component>().mark(entity);
+            mark_changed<Component>();
+            return fetch<Component>(entity);
+        }
+
+        template <typename Component>
+        void mark_dirty(entity_type entity) {
+            buffer_<Component>().mark(entity);
+        }
+
+        //同步点: 本帧的修改成为下一帧的 previous
+        void swap_buffers() {
+            for (auto &buffer : buffers_) {
+                if (buffer) {
+                    buffer->swap(*this);
+                }
+            }
+        }
+
+        //---------------------------空间索引--------------------------
+        //指定一种位置组件建立均匀网格索引, point 取出组件的坐标(2D 时 z 填 0)
+        //索引在每帧第一次查询时重建(flush_lifecycle 和位置组件的增删会让它失效), 同一帧内的查询共用一份
+        //同一帧内移动了实体又要让后面的查询看到新位置时, 调用 mark_spatial_dirty
+        template <typename Position>
+        void set_spatial_index(float cell_size, SpatialPoint(*point)(const Position&)) {
+            assert(!spatial_ && "spatial index already set");
+            assert(cell_size > 0);
+            spatial_.reset(new SpatialIndex<Position>(cell_size, point));
+            construction<Position>().connect<EntityManager, &EntityManager::spatialChanged>(this);
+            destruction<Position>().connect<EntityManager, &EntityManager::spatialChanged>(this);
+            spatial_dirty_ = true;
+        }
+
+        void mark_spatial_dirty() {
+            spatial_dirty_ = true;
+        }
+
+        //把到 center 距离不超过 radius 的实体追加到 out, 返回追加的个数
+        std::size_t query_region(const SpatialPoint& center, float radius, std::vector<entity_type>& out) {
+            assert(spatial_ && "set_spatial_index() not called");
+            if (spatial_dirty_) {
+                spatial_dirty_ = false;
+                spatial_->rebuild(*this);
+            }
+            auto size = out.size();
+            spatial_->query(center, radius, out);
+            return out.size() - size;
+        }
+
+        //给区域内的全部实体发一个 RegionEvent<Event>, 没有实体时不发; 返回实体个数
+        //接收者里可以再 broadcast: 每层嵌套用自己的缓冲, 外层事件里的实体列表不会被覆盖
+        template <typename Event, typename ... Args>
+        std::size_t broadcast(const SpatialPoint& center, float radius, Args && ... args) {
+            if (!(region_depth_ < region_entities_.size())) {
+                region_entities_.resize(region_depth_ + 1);
+            }
+            auto& entities = region_entities_[region_depth_];
+            entities.clear();
+            auto count = query_region(center, radius, entities);
+            if (count) {
+                ++region_depth_;
+                event_manager_.emit<RegionEvent<Event>>(RegionEvent<Event>(Event(std::forward<Args>(args)...), region_entities_[region_depth_ - 1].data(), count));
+                --region_depth_;
+            }
+            return count;
+        }
+
+        //---------------------------信箱--------------------------
+        //发给某个实体的消息(伤害、治疗、buff 等)先存进这种消息的信箱, 由系统调用 deliver_messages 一次处理
+        template <typename Message, typename ... Args>
+        void post(entity_type target, Args && ... args) {
+            auto &box = mailbox_<Message>();
+            box.targets.push_back(target);
+            box.messages.emplace_back(std::forward<Args>(args)...);
+        }
+
+        template <typename Message>
+        std::size_t pending_messages() const {
+            auto family = mailbox_family::type<Message>();
+            return family < mailboxes_.size() && mailboxes_[family] ? mailboxes_[family]->size() : 0;
+        }
+
+        template <typename Message>
+        void clear_messages() {
+            auto family = mailbox_family::type<Message>();
+            if (family < mailboxes_.size() && mailboxes_[family]) {
+                mailboxes_[family]->clear();
+            }
+        }
+
+        //按目标实体分组回调 func(entity, Message* messages, count), 目标按实体下标升序, 同一目标的消息保持投递顺序
+        //目标已经销毁的消息直接丢弃; 回调中 post 的同类消息留到下一次; 返回投递的消息数
+        template <typename Message, typename Func>
+        std::size_t deliver_messages(Func func) {
+            auto &box = mailbox_<Message>();
+            assert(!box.delivering && "deliver_messages() is not reentrant for the same message type");
+            box.delivering = true;
+            box.targets.swap(box.batch_targets);
+            box.messages.swap(box.batch_messages);
+
+            //高 32 位是实体下标, 低 32 位是投递顺序
+            auto count = box.batch_targets.size();
+            box.keys.resize(count);
+            for (std::size_t i = 0; i < count; ++i) {
+                box.keys[i] = (std::uint64_t(box.batch_targets[i] & traits_type::entity_mask) << 32) | std::uint64_t(i);
+            }
+            std::sort(box.keys.begin(), box.keys.end());
+            box.sorted.clear();
+            box.sorted.reserve(count);
+            for (auto key : box.keys) {
+                box.sorted.push_back(std::move(box.batch_messages[static_cast<std::size_t>(key & 0xffffffff)]));
+            }
+
+            std::size_t delivered = 0;
+            for (std::size_t begin = 0; begin < count;) {
+                auto target = box.batch_targets[static_cast<std::size_t>(box.keys[begin] & 0xffffffff)];
+                auto end = begin + 1;
+                while (end < count && box.batch_targets[static_cast<std::size_t>(box.keys[end] & 0xffffffff)] == target) {
+                    ++end;
+                }
+                if (valid(target)) {
+                    func(target, box.sorted.data() + begin, end - begin);
+                    delivered += end - begin;
+                }
+                begin = end;
+            }
+
+            box.batch_targets.clear();
+            box.batch_messages.clear();
+            box.sorted.clear();
+            box.delivering = false;
+            return delivered;
+        }
+
+        EntityManager(EventManager& events) :event_manager_(events) {}
+        EventManager &event_manager_;
+        std::vector<Entity> entityWrappers;
+
+    private:
+        using singleton_family = Family<struct SingletonFamily>;
+
+        //少于这个数量时排序不划算, 直接按输入顺序解析
+        static constexpr std::size_t resolve_sort_threshold = 32;
+
+        //开了冷存储的类型要先解压, 这一步会改动池, 不能和其它访问同一类型的系统并行
+        template <typename Component, typename Source>
+        void resolve_(std::size_t count, Component** out, Source source) {
+            thaw_batch_<Component>(count, source);
+            auto lookup = [this, out](std::size_t slot, entity_type entity, bool owned) {
+                Component* component = nullptr;
+                if (owned && valid(entity) && has<Component>(entity)) {
+                    component = &get<Component>(entity);
+                    ENTTWRAP_PREFETCH(component);
+                }
+                out[slot] = component;
+            };
+
+            entity_type entity;
+            if (count < resolve_sort_threshold) {
+                for (std::size_t i = 0; i < count; ++i) {
+                    bool owned = source(i, entity);
+                    lookup(i, entity, owned);
+                }
+                return;
+            }
+
+            //高 32 位是实体下标, 低 32 位是输入位置; 缓冲按线程分开, 多个系统可以同时解析
+            static thread_local std::vector<std::uint64_t> keys;
+            keys.resize(count);
+            for (std::size_t i = 0; i < count; ++i) {
+                source(i, entity);
+                keys[i] = (std::uint64_t(entity & traits_type::entity_mask) << 32) | std::uint64_t(i);
+            }
+            std::sort(keys.begin(), keys.end());
+            for (auto key : keys) {
+                auto slot = static_cast<std::size_t>(key & 0xffffffff);
+                bool owned = source(slot, entity);
+                lookup(slot, entity, owned);
+            }
+        }
+
+        using mailbox_family = Family<struct MailboxFamily>;
+
+        struct BaseMailbox {
+            virtual ~BaseMailbox() = default;
+            virtual std::size_t size() const = 0;
+            virtual void clear() = 0;
+        };
+
+        //targets/messages 是待投递的, batch_* 是正在投递的一批, 交换使用以复用容量
+        template <typename Message>
+        struct Mailbox : BaseMailbox {
+            std::size_t size() const override {
+                return targets.size();
+            }
+
+            void clear() override {
+                targets.clear();
+                messages.clear();
+            }
+
+            std::vector<entity_type> targets;
+            std::vector<Message> messages;
+            std::vector<entity_type> batch_targets;
+            std::vector<Message> batch_messages;
+            std::vector<Message> sorted;
+            std::vector<std::uint64_t> keys;
+            bool delivering = false;
+        };
+
+        template <typename Message>
+        Mailbox<Message>& mailbox_() {
+            auto family = mailbox_family::type<Message>();
+            if (!(family < mailboxes_.size())) {
+                mailboxes_.resize(family + 1);
+            }
+            if (!mailboxes_[family]) {
+                mailboxes_[family].reset(new Mailbox<Message>());
+            }
+            return *static_cast<Mailbox<Message>*>(mailboxes_[family].get());
+        }
+
+        std::vector<std::unique_ptr<BaseMailbox>> mailboxes_;
+
+        struct BaseSpatialIndex {
+            virtual ~BaseSpatialIndex() = default;
+            virtual void rebuild(EntityManager& manager) = 0;
+            virtual void query(const SpatialPoint& center, float radius, std::vector<entity_type>& out) const = 0;
+        };
+
+        //实体按网格 key 基数排序后连续存放, cells 是排好序的不重复 key, starts[i] 是 cells[i] 在 entities 里的起点
+        //不同格子的 key 可能冲突, 查询时逐个比较距离, 所以不影响结果
+        template <typename Position>
+        struct SpatialIndex : BaseSpatialIndex {
+            SpatialIndex(float cell_size, SpatialPoint(*point)(const Position&)) :
+                cell_size(cell_size), point(point) {}
+
+            //超出 int32 的坐标截到边界, 避免浮点转整数溢出
+            std::int32_t cell_(float value) const {
+                float cell = std::floor(value / cell_size);
+                if (!(cell > float(std::numeric_limits<std::int32_t>::min()))) {
+                    return std::numeric_limits<std::int32_t>::min();
+                }
+                if (!(cell < float(std::numeric_limits<std::int32_t>::max()))) {
+                    return std::numeric_limits<std::int32_t>::max();
+                }
+                return static_cast<std::int32_t>(cell);
+            }
+
+            static std::uint32_t key_(std::int32_t x, std::int32_t y, std::int32_t z) {
+                return (std::uint32_t(x) * 73856093u) ^ (std::uint32_t(y) * 19349663u) ^ (std::uint32_t(z) * 83492791u);
+            }
+
+            void rebuild(EntityManager& manager) override {
+                manager.thaw_all<Position>();
+                auto count = manager.size<Position>();
+                const Position* raw = manager.raw<Position>();
+                const entity_type* data = manager.data<Position>();
+                keys.resize(count);
+                unsorted.resize(count);
+                for (std::size_t i = 0; i < count; ++i) {
+                    unsorted[i] = point(raw[i]);
+                    keys[i] = key_(cell_(unsorted[i].x), cell_(unsorted[i].y), cell_(unsorted[i].z));
+                }
+                RadixSort::sort(keys.data(), count, order, scratch);
+
+                entities.resize(count);
+                points.resize(count);
+                cells.clear();
+                starts.clear();
+                for (std::size_t i = 0; i < count; ++i) {
+                    auto index = order[i];
+                    entities[i] = data[index];
+                    points[i] = unsorted[index];
+                    if (cells.empty() || cells.back() != keys[index]) {
+                        cells.push_back(keys[index]);
+                        starts.push_back(i);
+                    }
+                }
+                starts.push_back(count);
+                visited.assign(cells.size(), 0);
+                stamp = 0;
+            }
+
+            void query(const SpatialPoint& center, float radius, std::vector<entity_type>& out) const override {
+                auto collect = [&](std::size_t begin, std::size_t end) {
+                    for (auto i = begin; i < end; ++i) {
+                        float dx = points[i].x - center.x, dy = points[i].y - center.y, dz = points[i].z - center.z;
+                        if (dx * dx + dy * dy + dz * dz <= radius * radius) {
+                            out.push_back(entities[i]);
+                        }
+                    }
+                };
+
+                auto x0 = cell_(center.x - radius), x1 = cell_(center.x + radius);
+                auto y0 = cell_(center.y - radius), y1 = cell_(center.y + radius);
+                auto z0 = cell_(center.z - radius), z1 = cell_(center.z + radius);
+                //覆盖的格子比非空格子还多时, 直接扫描全部
+                double covered = double(std::int64_t(x1) - x0 + 1) * double(std::int64_t(y1) - y0 + 1) * double(std::int64_t(z1) - z0 + 1);
+                if (covered > double(cells.size())) {
+                    collect(0, entities.size());
+                    return;
+                }
+                //两个被覆盖的格子 key 冲突时同一段只收集一次: 本次查询收集过的格子标上当前的 stamp
+                if (++stamp == 0) {
+                    std::fill(visited.begin(), visited.end(), 0);
+                    stamp = 1;
+                }
+                for (std::int64_t z = z0; z <= z1; ++z) {
+                    for (std::int64_t y = y0; y <= y1; ++y) {
+                        for (std::int64_t x = x0; x <= x1; ++x) {
+                            auto key = key_(std::int32_t(x), std::int32_t(y), std::int32_t(z));
+                            auto it = std::lower_bound(cells.begin(), cells.end(), key);
+                            if (it != cells.end() && *it == key) {
+                                auto cell = std::size_t(it - cells.begin());
+                                if (visited[cell] != stamp) {
+                                    visited[cell] = stamp;
+                                    collect(starts[cell], starts[cell + 1]);
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+
+            float cell_size;
+            SpatialPoint(*point)(const Position&);
+            std::vector<std::uint32_t> keys;
+            std::vector<std::uint32_t> order;
+            std::vector<std::uint32_t> scratch;
+            std::vector<SpatialPoint> unsorted;
+            std::vector<entity_type> entities;
+            std::vector<SpatialPoint> points;
+            std::vector<std::uint32_t> cells;
+            std::vector<std::size_t> starts;
+            mutable std::vector<std::uint32_t> visited;
+            mutable std::uint32_t stamp = 0;
+        };
+
+        void spatialChanged(DefaultRegistry &, entity_type) {
+            spatial_dirty_ = true;
+        }
+
+        using buffer_family = Family<struct BufferFamily>;
+
+        struct BaseComponentBuffer {
+            virtual ~BaseComponentBuffer() = default;
+            virtual void swap(EntityManager& manager) = 0;
+        };
+
+        //previous 按实体下标存放; dirty 记录本帧改过的实体, flags 用来去重
+        //mark 可以并发: 把 flags 从 0 换成 1 的线程占 dirty 的一格, 每个实体每帧最多占一格, 所以 dirty 和 flags 一样大就够
+        template <typename Component>
+        struct ComponentBuffer : BaseComponentBuffer {
+            void store(entity_type entity, const Component& component) {
+                auto index = entity & traits_type::entity_mask;
+                if (!(index < previous.size())) {
+                    previous.resize(index + 1);
+                }
+                if (!(index < capacity)) {
+                    grow_(std::max(std::size_t(index) + 1, capacity * 2));
+                }
+                previous[index] = component;
+            }
+
+            void mark(entity_type entity) {
+                auto index = entity & traits_type::entity_mask;
+                assert(index < capacity && "entity has no double-buffered component");
+                if (!flags[index].exchange(1, std::memory_order_relaxed)) {
+                    dirty[count.fetch_add(1, std::memory_order_relaxed)] = entity;
+                }
+            }
+
+            void swap(EntityManager& manager) override {
+                auto marked = count.load(std::memory_order_relaxed);
+                for (std::size_t i = 0; i < marked; ++i) {
+                    auto entity = dirty[i];
+                    auto index = entity & traits_type::entity_mask;
+                    flags[index].store(0, std::memory_order_relaxed);
+                    if (manager.valid(entity) && manager.thaw<Component>(entity)) {
+                        previous[index] = manager.get<Component>(entity);
+                    }
+                }
+                count.store(0, std::memory_order_relaxed);
+            }
+
+            //只在主线程添加组件时扩容, 这时没有并发的 mark
+            void grow_(std::size_t size) {
+                std::unique_ptr<std::atomic<std::uint8_t>[]> grown_flags(new std::atomic<std::uint8_t>[size]);
+                std::unique_ptr<entity_type[]> grown_dirty(new entity_type[size]);
+                for (std::size_t i = 0; i < size; ++i) {
+                    grown_flags[i].store(i < capacity ? flags[i].load(std::memory_order_relaxed) : std::uint8_t(0), std::memory_order_relaxed);
+                }
+                std::copy(dirty.get(), dirty.get() + count.load(std::memory_order_relaxed), grown_dirty.get());
+                flags = std::move(grown_flags);
+                dirty = std::move(grown_dirty);
+                capacity = size;
+            }
+
+            std::vector<Component> previous;
+            std::unique_ptr<std::atomic<std::uint8_t>[]> flags;
+            std::unique_ptr<entity_type[]> dirty;
+            std::size_t capacity = 0;
+            std::atomic<std::size_t> count{ 0 };
+        };
+
+        //没有 double_buffer 的类型什么也不做
+        template <typename Component>
+        void mark_buffered_(entity_type entity) {
+            auto family = buffer_family::type<Component>();
+            if (family < buffers_.size() && buffers_[family]) {
+                mark_dirty<Component>(entity);
+            }
+        }
+
+        template <typename Component>
+        ComponentBuffer<Component>& buffer_() const {
+            auto family = buffer_family::type<Component>();
+            assert(family < buffers_.size() && buffers_[family] && "EntityManager::double_buffer() not called");
+            return *static_cast<ComponentBuffer<Component>*>(buffers_[family].get());
+        }
+
+        //冷存储和休眠搬回来的组件还是原来的值, 不覆盖 previous
+        template <typename Component>
+        void bufferAddComponent(DefaultRegistry & entityManager, entity_type entity) {
+            if (!storage_moving_) {
+                buffer_<Component>().store(entity, get<Component>(entity));
+            }
+        }
+
+        std::vector<std::unique_ptr<BaseComponentBuffer>> buffers_;
+
+        template <typename Component>
+        void prefetch_component_(entity_type entity) {
+            ENTTWRAP_PREFETCH(&get<Component>(entity));
+        }
+
+        using change_family = Family<struct ChangeFamily>;
+        static constexpr std::uint64_t no_version = ~std::uint64_t(0);    //没有 watch 的组件
+
+        template <typename Component>
+        void countChange(DefaultRegistry & entityManager, entity_type entity) {
+            if (!storage_moving_) {
+                ++change_versions_[change_family::type<Component>()];
+            }
+        }
+
+        //write 可以在 update_parallel 的多个任务里同时调用, 计数用原子量; deque 扩容不搬动已有元素
+        std::deque<std::atomic<std::uint64_t>> change_versions_;
+
+        std::unique_ptr<BaseSpatialIndex> spatial_;
+        bool spatial_dirty_ = false;
+        std::vector<std::vector<entity_type>> region_entities_;
+        std::size_t region_depth_ = 0;
+
+        //撤销记录; 可平凡拷贝的旧值存在 undo_bytes_ 里, 其它类型单独分配在 object 上
+        //undo(manager, record, false) 只释放旧值, 用于 commit
+        struct UndoRecord {
+            void(*undo)(EntityManager&, const UndoRecord&, bool);
+            entity_type entity;
+            std::size_t offset;
+            void* object;
+        };
+
+        //回滚的实体从没存在过: 从 created_ 里拿掉, 不经过 destroy, 所以不派发 EntitiesCreated/EntitiesDestroyed
+        static void undo_create_(EntityManager& manager, const UndoRecord& record, bool apply) {
+            if (apply && manager.valid(record.entity)) {
+                auto it = std::find(manager.created_.rbegin(), manager.created_.rend(), record.entity);
+                if (it != manager.created_.rend()) {
+                    manager.created_.erase(std::next(it).base());
+                }
+                manager.DefaultRegistry::destroy(record.entity);
+            }
+        }
+
+        template <typename Component>
+        static void undo_assign_(EntityManager& manager, const UndoRecord& record, bool apply) {
+            if (apply && manager.valid(record.entity) && manager.has<Component>(record.entity)) {
+                manager.DefaultRegistry::remove<Component>(record.entity);
+            }
+        }
+
+        template <typename Component>
+        static void undo_value_(EntityManager& manager, const UndoRecord& record, bool apply) {
+            manager.restore_value_<Component>(record, apply, std::is_trivially_copyable<Component>{});
+            if (!apply && manager.valid(record.entity) && manager.thaw<Component>(record.entity)) {
+                manager.journal_write<Component>(record.entity);
+            }
+        }
+
+        template <typename Component>
+        void journal_value_(entity_type entity) {
+            UndoRecord record{ &EntityManager::undo_value_<Component>, entity, undo_bytes_.size(), nullptr };
+            save_value_(record, fetch<Component>(entity), std::is_trivially_copyable<Component>{});
+            undo_log_.push_back(record);
+        }
+
+        template <typename Component>
+        void save_value_(UndoRecord&, const Component& value, std::true_type) {
+            auto bytes = reinterpret_cast<const unsigned char*>(&value);
+            undo_bytes_.insert(undo_bytes_.end(), bytes, bytes + sizeof(Component));
+        }
+
+        template <typename Component>
+        void save_value_(UndoRecord& record, const Component& value, std::false_type) {
+            record.object = new Component(value);
+        }
+
+        template <typename Component>
+        void restore_value_(const UndoRecord& record, bool apply, std::true_type) {
+            if (apply) {
+                typename std::aligned_storage<sizeof(Component), alignof(Component)>::type storage;
+                std::memcpy(&storage, undo_bytes_.data() + record.offset, sizeof(Component));
+                restore_<Component>(record.entity, std::move(*reinterpret_cast<Component*>(&storage)));
+            }
+        }
+
+        template <typename Component>
+        void restore_value_(const UndoRecord& record, bool apply, std::false_type) {
+            std::unique_ptr<Component> value(static_cast<Component*>(record.object));
+            if (apply) {
+                restore_<Component>(record.entity, std::move(*value));
+            }
+        }
+
+        template <typename Component>
+        void restore_(entity_type entity, Component&& value) {
+            if (!valid(entity)) {
+                return;
+            }
+            if (has<Component>(entity)) {
+                get<Component>(entity) = std::move(value);
+            } else {
+                DefaultRegistry::assign<Component>(entity, std::move(value));
+            }
+        }
+
+        //Transaction::remove 推迟到 commit 执行的移除
+        struct DoomedComponent {
+            void(*remove)(EntityManager&, entity_type);
+            entity_type entity;
+        };
+
+        template <typename Component>
+        static void remove_doomed_(EntityManager& manager, entity_type entity) {
+            if (manager.valid(entity) && manager.thaw<Component>(entity)) {
+                manager.DefaultRegistry::remove<Component>(entity);
+            }
+        }
+
+        void close_transaction_() {
+            undo_log_.clear();
+            undo_bytes_.clear();
+            doomed_.clear();
+            doomed_components_.clear();
+            transaction_open_ = false;
+        }
+
+        using journal_family = Family<struct JournalFamily>;
+        static constexpr std::uint32_t no_type = 0xffffffff;
+
+        struct JournalType {
+            void(*write)(EntityManager&, entity_type, const unsigned char*);
+            void(*remove)(EntityManager&, entity_type);
+            std::uint32_t size;
+        };
+
+        template <typename Component>
+        bool journaled_() const {
+            auto family = journal_family::type<Component>();
+            return family < journal_ids_.size() && journal_ids_[family] != no_type;
+        }
+
+        template<typename Component>
+        void journalAddComponent(DefaultRegistry & entityManager, entity_type entity) {
+            if (storage_moving_) {
+                return;
+            }
+            journal_write<Component>(entity);
+        }
+
+        template<typename Component>
+        void journalRemoveComponent(DefaultRegistry & entityManager, entity_type entity) {
+            if (journal_ && !storage_moving_) {
+                journal_->append(Journal::Remove, entity, journal_ids_[journal_family::type<Component>()]);
+            }
+        }
+
+        template <typename Component>
+        static void replay_write_(EntityManager& manager, entity_type entity, const unsigned char* payload) {
+            Component component;
+            std::memcpy(&component, payload, sizeof(Component));
+            if (manager.has<Component>(entity)) {
+                manager.get<Component>(entity) = component;
+            } else {
+                manager.DefaultRegistry::assign<Component>(entity, component);
+            }
+        }
+
+        template <typename Component>
+        static void replay_remove_(EntityManager& manager, entity_type entity) {
+            if (manager.thaw<Component>(entity)) {
+                manager.DefaultRegistry::remove<Component>(entity);
+            }
+        }
+
+        using cold_family = Family<struct ColdFamily>;
+
+        class BaseColdPool {
+        public:
+            virtual ~BaseColdPool() = default;
+            virtual void compress(EntityManager& manager, std::uint32_t idle_frames) = 0;
+            virtual void thaw_all(EntityManager& manager) = 0;
+            virtual bool thaw_entity(EntityManager& manager, entity_type entity) = 0;
+
+            //实体下标 -> 压缩在页里的实体(带版本), 不在冷页里的是 none
+            bool holds(entity_type entity) const {
+                auto index = entity & traits_type::entity_mask;
+                return index < frozen.size() && frozen[index] == entity;
+            }
+
+            static constexpr entity_type none = ~entity_type(0);
+            std::vector<entity_type> frozen;
+            ColdStats stats;
+            std::uint64_t view_frame = 0;
+        };
+
+        template <typename Component>
+        class ColdPool : public BaseColdPool {
+            static const std::size_t page_shift = 8;
+
+            struct Page {
+                std::vector<unsigned char> blob;
+                std::uint32_t count = 0;
+            };
+
+        public:
+            void touch(entity_type entity, std::uint64_t frame) {
+                auto page = page_of_(entity);
+                if (!(page < last_access_.size())) {
+                    last_access_.resize(page + 1, frame);
+                }
+                last_access_[page] = frame;
+            }
+
+            void compress(EntityManager& manager, std::uint32_t idle_frames) override {
+                auto frame = manager.cold_frame_;
+                if (view_frame + idle_frames >= frame) {
+                    return;
+                }
+                std::vector<entity_type> stale;
+                const entity_type* entities = manager.data<Component>();
+                for (std::size_t i = 0, size = manager.size<Component>(); i < size; ++i) {
+                    auto page = page_of_(entities[i]);
+                    if (!(page < last_access_.size())) {
+                        last_access_.resize(page + 1, frame);
+                    }
+                    if (last_access_[page] + idle_frames < frame) {
+                        stale.push_back(entities[i]);
+                    }
+                }
+                std::sort(stale.begin(), stale.end(), [](entity_type lhs, entity_type rhs) {
+                    return (lhs & traits_type::entity_mask) < (rhs & traits_type::entity_mask);
+                });
+                for (std::size_t first = 0, last; first < stale.size(); first = last) {
+                    auto page = page_of_(stale[first]);
+                    for (last = first + 1; last < stale.size() && page_of_(stale[last]) == page; ++last);
+                    if (page < pages_.size() && pages_[page].count) {
+                        thaw_page_(manager, page);
+                    }
+                    freeze_page_(manager, page, stale.data() + first, last - first);
+                }
+            }
+
+            bool thaw(EntityManager& manager, entity_type entity) {
+                if (!holds(entity)) {
+                    return false;
+                }
+                thaw_page_(manager, page_of_(entity));
+                return true;
+            }
+
+            bool thaw_entity(EntityManager& manager, entity_type entity) override {
+                return thaw(manager, entity);
+            }
+
+            void thaw_all(EntityManager& manager) override {
+                view_frame = manager.cold_frame_;
+                if (stats.pages) {
+                    for (std::size_t page = 0; page < pages_.size(); ++page) {
+                        if (pages_[page].count) {
+                            thaw_page_(manager, page);
+                        }
+                    }
+                }
+            }
+
+        private:
+            static std::size_t page_of_(entity_type entity) {
+                return (entity & traits_type::entity_mask) >> page_shift;
+            }
+
+            //页内布局: 先是全部实体 ID, 然后是同样顺序的组件
+            void freeze_page_(EntityManager& manager, std::size_t page, const entity_type* entities, std::size_t count) {
+                std::size_t raw_size = count * (sizeof(entity_type) + sizeof(Component));
+                raw_.resize(raw_size);
+                std::memcpy(raw_.data(), entities, count * sizeof(entity_type));
+                unsigned char* components = raw_.data() + count * sizeof(entity_type);
+                for (std::size_t i = 0; i < count; ++i) {
+                    std::memcpy(components + i * sizeof(Component), &manager.get<Component>(entities[i]), sizeof(Component));
+                }
+
+                if (!(page < pages_.size())) {
+                    pages_.resize(page + 1);
+                }
+                ColdCodec::compress(raw_.data(), raw_size, pages_[page].blob);
+                pages_[page].blob.shrink_to_fit();
+                pages_[page].count = std::uint32_t(count);
+
+                bool moving = manager.storage_moving_;
+                manager.storage_moving_ = true;
+                for (std::size_t i = 0; i < count; ++i) {
+                    auto index = entities[i] & traits_type::entity_mask;
+                    if (!(index < frozen.size())) {
+                        frozen.resize(index + 1, entity_type(none));
+                    }
+                    frozen[index] = entities[i];
+                    manager.DefaultRegistry::remove<Component>(entities[i]);
+                }
+                manager.storage_moving_ = moving;
+
+                stats.pages += 1;
+                stats.entities += count;
+                stats.raw_bytes += raw_size;
+                stats.compressed_bytes += pages_[page].blob.size();
+            }
+
+            //已经销毁或者 ID 被复用的实体直接丢弃
+            void thaw_page_(EntityManager& manager, std::size_t page) {
+                Page& cold = pages_[page];
+                std::size_t count = cold.count;
+                std::size_t raw_size = count * (sizeof(entity_type) + sizeof(Component));
+                raw_.resize(raw_size);
+                ColdCodec::decompress(cold.blob.data(), cold.blob.size(), raw_);
+
+                bool moving = manager.storage_moving_;
+                manager.storage_moving_ = true;
+                const unsigned char* components = raw_.data() + count * sizeof(entity_type);
+                for (std::size_t i = 0; i < count; ++i) {
+                    entity_type entity;
+                    std::memcpy(&entity, raw_.data() + i * sizeof(entity_type), sizeof(entity_type));
+                    frozen[entity & traits_type::entity_mask] = entity_type(none);
+                    if (manager.valid(entity) && !manager.has<Component>(entity)) {
+                        Component component;
+                        std::memcpy(&component, components + i * sizeof(Component), sizeof(Component));
+                        manager.DefaultRegistry::assign<Component>(entity, component);
+                    }
+                }
+                manager.storage_moving_ = moving;
+
+                stats.pages -= 1;
+                stats.entities -= count;
+                stats.raw_bytes -= raw_size;
+                stats.compressed_bytes -= cold.blob.size();
+                std::vector<unsigned char>().swap(cold.blob);
+                cold.count = 0;
+                if (page < last_access_.size()) {
+                    last_access_[page] = manager.cold_frame_;
+                }
+            }
+
+            std::vector<std::uint64_t> last_access_;
+            std::vector<Page> pages_;
+            std::vector<unsigned char> raw_;
+        };
+
+        template <typename Component>
+        ColdPool<Component>* cold_pool_() {
+            auto family = cold_family::type<Component>();
+            return family < cold_pools_.size() ? static_cast<ColdPool<Component>*>(cold_pools_[family].get()) : nullptr;
+        }
+
+        template <typename Component>
+        void thaw_all_() {
+            if (auto pool = cold_pool_<Component>()) {
+                pool->thaw_all(*this);
+            }
+        }
+
+        //批量接口取地址之前先解压用到的冷页, 免得中途解压让池扩容, 已经取到的地址失效; source(i, entity) 同 resolve_
+        template <typename Component, typename Source>
+        void thaw_batch_(std::size_t count, Source source) {
+            auto pool = cold_pools_.empty() ? nullptr : cold_pool_<Component>();
+            if (!pool) {
+                return;
+            }
+            entity_type entity;
+            for (std::size_t i = 0; i < count; ++i) {
+                if (source(i, entity) && valid(entity)) {
+                    pool->touch(entity, cold_frame_);
+                    if (!has<Component>(entity)) {
+                        pool->thaw(*this, entity);
+                    }
+                }
+            }
+        }
+
+        using hibernation_family = Family<struct HibernationFamily>;
+
+        struct HibernationSlot {
+            std::uint64_t offset;
+            std::uint32_t size;
+        };
+
+        struct HibernationType {
+            bool(*save)(EntityManager&, entity_type, std::uint32_t, std::vector<unsigned char>&);
+            void(*remove)(EntityManager&, entity_type);
+            void(*restore)(EntityManager&, entity_type, const unsigned char*);
+            std::uint32_t size;
+        };
+
+        //每个组件写成 [类型][大小][数据]; 只序列化, 写盘成功后再由 hibernate_remove_ 移除
+        template <typename Component>
+        static bool hibernate_save_(EntityManager& manager, entity_type entity, std::uint32_t type, std::vector<unsigned char>& buffer) {
+            if (!manager.thaw<Component>(entity)) {
+                return false;
+            }
+            std::uint32_t header[2] = { type, std::uint32_t(sizeof(Component)) };
+            auto bytes = reinterpret_cast<const unsigned char*>(header);
+            buffer.insert(buffer.end(), bytes, bytes + sizeof(header));
+            bytes = reinterpret_cast<const unsigned char*>(&manager.get<Component>(entity));
+            buffer.insert(buffer.end(), bytes, bytes + sizeof(Component));
+            return true;
+        }
+
+        template <typename Component>
+        static void hibernate_remove_(EntityManager& manager, entity_type entity) {
+            if (manager.has<Component>(entity)) {
+                manager.DefaultRegistry::remove<Component>(entity);
+            }
+        }
+
+        template <typename Component>
+        static void hibernate_restore_(EntityManager& manager, entity_type entity, const unsigned char* payload) {
+            Component component;
+            std::memcpy(&component, payload, sizeof(Component));
+            if (manager.has<Component>(entity)) {
+                manager.get<Component>(entity) = component;
+            } else {
+                manager.DefaultRegistry::assign<Component>(entity, component);
+            }
+        }
+
+        std::vector<entity_type> created_;
+        std::vector<entity_type> destroyed_;
+        std::vector<entity_type> flushing_created_;
+        std::vector<entity_type> flushing_destroyed_;
+
+        HibernationStore* hibernation_store_ = nullptr;
+        std::vector<HibernationType> hibernation_types_;
+        std::vector<std::uint32_t> hibernation_ids_;
+        std::unordered_map<entity_type, HibernationSlot> hibernated_;
+
+        std::vector<std::unique_ptr<BaseColdPool>> cold_pools_;
+        std::uint64_t cold_frame_ = 0;
+        bool storage_moving_ = false;
+
+        Journal* journal_ = nullptr;
+        std::vector<JournalType> journal_types_;
+        std::vector<std::uint32_t> journal_ids_;
+
+        bool transaction_open_ = false;
+        bool deferring_events_ = false;     //Transaction 的操作正在进行, 组件事件排进 pending_events_
+        std::vector<UndoRecord> undo_log_;
+        std::vector<unsigned char> undo_bytes_;
+        std::vector<entity_type> doomed_;
+        std::vector<DoomedComponent> doomed_components_;
+        std::vector<std::function<void()>> pending_events_;
+
+        //gather/scatter 提前探测的实体数, 必须是 2 的幂
+        static constexpr std::size_t transfer_lookahead = 8;
+
+        //按输入顺序回调 func(i, component), 同时提前 transfer_lookahead 个实体探测并预取
+        template <typename Component, typename Func>
+        std::size_t pipelined_(const entity_type* entities, std::size_t count, Func func) {
+            thaw_batch_<Component>(count, [entities](std::size_t i, entity_type& entity) {
+                entity = entities[i];
+                return true;
+            });
+            Component* window[transfer_lookahead];
+            auto probe = [this](entity_type entity) -> Component* {
+                if (valid(entity) && has<Component>(entity)) {
+                    Component* component = &get<Component>(entity);
+                    ENTTWRAP_PREFETCH(component);
+                    return component;
+                }
+                return nullptr;
+            };
+
+            for (std::size_t i = 0; i < count && i < transfer_lookahead; ++i) {
+                window[i] = probe(entities[i]);
+            }
+            std::size_t found = 0;
+            for (std::size_t i = 0; i < count; ++i) {
+                Component* component = window[i & (transfer_lookahead - 1)];
+                if (i + transfer_lookahead < count) {
+                    window[i & (transfer_lookahead - 1)] = probe(entities[i + transfer_lookahead]);
+                }
+                if (component) {
+                    func(i, component);
+                    ++found;
+                }
+            }
+            return found;
+        }
+
+        //池里地址连续的一段合并成一次拷贝, 可平凡拷贝的类型走 memcpy
+        template <typename Component, bool ToPool>
+        std::size_t transfer_(const entity_type* entities, std::size_t count, Component* buffer) {
+            Component* run = nullptr;
+            std::size_t first = 0;
+            std::size_t length = 0;
+            auto flush = [&]() {
+                if (length) {
+                    if (ToPool) {
+                        copy_range_(buffer + first, length, run, std::is_trivially_copyable<Component>{});
+                    } else {
+                        copy_range_(run, length, buffer + first, std::is_trivially_copyable<Component>{});
+                    }
+                }
+            };
+            auto found = pipelined_<Component>(entities, count, [&](std::size_t i, Component* component) {
+                if (length && i == first + length && component == run + length) {
+                    ++length;
+                    return;
+                }
+                flush();
+                run = component;
+                first = i;
+                length = 1;
+            });
+            flush();
+            return found;
+        }
+
+        template <typename Component>
+        static void copy_range_(const Component* from, std::size_t length, Component* to, std::true_type) {
+            std::memcpy(to, from, length * sizeof(Component));
+        }
+
+        template <typename Component>
+        static void copy_range_(const Component* from, std::size_t length, Component* to, std::false_type) {
+            std::copy_n(from, length, to);
+        }
+
+        template <typename Singleton, typename Archive>
+        void snapshot_singleton(Archive &archive) const {
+            if (has_singleton<Singleton>()) {
+                archive(static_cast<entity_type>(1));
+                archive(static_cast<entity_type>(Entity::INVALID), singleton<Singleton>());
+            } else {
+                archive(static_cast<entity_type>(0));
+            }
+        }
+
+        template <typename Singleton, typename Archive>
+        void restore_singleton(Archive &archive) {
+            entity_type length;
+            archive(length);
+            if (length) {
+                entity_type entity;
+                Singleton singleton;
+                archive(entity, singleton);
+                set_singleton<Singleton>(std::move(singleton));
+            } else {
+                remove_singleton<Singleton>();
+            }
+        }
+
+        std::vector<std::shared_ptr<void>> singletons_;
+    };
+
+    //常驻的工作线程, 任务放在一个共享队列里; 等任务完成的线程也会帮忙执行队列里的任务
+    //线程数为 0 时全部任务都在等待的线程上执行
+    class WorkerPool {
+    public:
+        explicit WorkerPool(std::size_t threads = std::max(1u, std::thread::hardware_concurrency()) - 1) {
+            for (std::size_t i = 0; i < threads; ++i) {
+                workers_.emplace_back([this] { loop_(); });
+            }
+        }
+
+        WorkerPool(const WorkerPool&) = delete;
+        WorkerPool& operator= (const WorkerPool&) = delete;
+
+        ~WorkerPool() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stopping_ = true;
+            }
+            wake_.notify_all();
+            for (auto &worker : workers_) {
+                worker.join();
+            }
+        }
+
+        void submit(std::function<void()> job) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                jobs_.push_back(std::move(job));
+            }
+            wake_.notify_one();
+        }
+
+        //done 变化后要调用 notify_all, 否则等待的线程可能一直睡下去
+        void notify_all() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+            }
+            wake_.notify_all();
+        }
+
+        template <typename Done>
+        void help_until(Done done) {
+            for (;;) {
+                std::function<void()> job;
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    wake_.wait(lock, [this, &done] { return !jobs_.empty() || done(); });
+                    if (jobs_.empty()) {
+                        return;
+                    }
+                    job = std::move(jobs_.front());
+                    jobs_.pop_front();
+                }
+                job();
+            }
+        }
+
+        std::size_t size() const {
+            return workers_.size();
+        }
+
+    private:
+        void loop_() {
+            for (;;) {
+                std::function<void()> job;
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    wake_.wait(lock, [this] { return !jobs_.empty() || stopping_; });
+                    if (jobs_.empty()) {
+                        return;
+                    }
+                    job = std::move(jobs_.front());
+                    jobs_.pop_front();
+                }
+                job();
+            }
+        }
+
+        std::vector<std::thread> workers_;
+        std::deque<std::function<void()>> jobs_;
+        std::mutex mutex_;
+        std::condition_variable wake_;
+        bool stopping_ = false;
+    };
+
+    //系统在 BaseSystem::schedule 里提交的任务图, 由 SystemManager::update_parallel 在 WorkerPool 上执行
+    //没有依赖关系的任务(包括不同系统的)可以并行; 任务只能在 schedule 里添加, 不能在任务执行时添加
+    class TaskGraph {
+    public:
+        using TaskId = std::size_t;
+        static constexpr TaskId no_task = ~std::size_t(0);
+
+        //dependencies 里的 no_task 被忽略
+        TaskId add(std::function<void()> work, std::initializer_list<TaskId> dependencies = {}) {
+            return add_(std::move(work), dependencies.begin(), dependencies.end());
+        }
+
+        TaskId add(std::function<void()> work, const std::vector<TaskId>& dependencies) {
+            return add_(std::move(work), dependencies.data(), dependencies.data() + dependencies.size());
+        }
+
+        //当前系统到目前为止提交的任务全部完成后才完成, 作为后续任务的依赖使用
+        TaskId fence() {
+            return add_(nullptr, system_tasks_.data(), system_tasks_.data() + system_tasks_.size());
+        }
+
+        //排在当前系统前面的所有系统都完成; 第一个系统返回 no_task
+        TaskId previous() const {
+            return previous_;
+        }
+
+        //System 以及排在它前面的所有系统都完成; System 必须排在当前系统之前
+        template <typename System>
+        TaskId after() const {
+            auto it = completions_.find(System::template type<System>());
+            assert(it != completions_.end() && "System is not scheduled before the current system");
+            return it == completions_.end() ? previous_ : it->second;
+        }
+
+        std::size_t size() const {
+            return tasks_.size();
+        }
+
+        void clear() {
+            tasks_.clear();
+            system_tasks_.clear();
+            completions_.clear();
+            previous_ = no_task;
+        }
+
+        void run(WorkerPool& pool) {
+            if (tasks_.empty()) {
+                return;
+            }
+            pending_.reset(new std::atomic<std::size_t>[tasks_.size()]);
+            for (std::size_t i = 0; i < tasks_.size(); ++i) {
+                pending_[i].store(tasks_[i].dependencies, std::memory_order_relaxed);
+            }
+            remaining_.store(tasks_.size());
+            for (std::size_t i = 0; i < tasks_.size(); ++i) {
+                if (!tasks_[i].dependencies) {
+                    submit_(pool, i);
+                }
+            }
+            pool.help_until([this] { return remaining_.load() == 0; });
+        }
+
+    private:
+        friend class SystemManager;
+
+        struct Task {
+            std::function<void()> work;
+            std::vector<TaskId> successors;
+            std::size_t dependencies;
+        };
+
+        template <typename It>
+        TaskId add_(std::function<void()> work, It first, It last) {
+            TaskId id = tasks_.size();
+            tasks_.push_back(Task{ std::move(work), {}, 0 });
+            for (; first != last; ++first) {
+                if (*first != no_task) {
+                    assert(*first < id);
+                    tasks_[*first].successors.push_back(id);
+                    ++tasks_[id].dependencies;
+                }
+            }
+            system_tasks_.push_back(id);
+            return id;
+        }
+
+        void submit_(WorkerPool& pool, TaskId id) {
+            pool.submit([this, &pool, id] {
+                if (tasks_[id].work) {
+                    tasks_[id].work();
+                }
+                for (auto successor : tasks_[id].successors) {
+                    if (--pending_[successor] == 0) {
+                        submit_(pool, successor);
+                    }
+                }
+                if (--remaining_ == 0) {
+                    pool.notify_all();
+                }
+            });
+        }
+
+        void begin_system_() {
+            system_tasks_.clear();
+        }
+
+        //系统的完成点同时依赖前面的完成点, 所以 previous 总是表示"前面全部完成"
+        void end_system_(std::size_t family) {
+            if (!system_tasks_.empty()) {
+                system_tasks_.push_back(previous_);
+                previous_ = fence();
+            }
+            completions_[family] = previous_;
+        }
+
+        std::vector<Task> tasks_;
+        std::vector<TaskId> system_tasks_;
+        std::unordered_map<std::size_t, TaskId> completions_;
+        TaskId previous_ = no_task;
+        std::unique_ptr<std::atomic<std::size_t>[]> pending_;
+        std::atomic<std::size_t> remaining_{ 0 };
+    };
+
+    //可降级系统超出帧预算时的降级方式
+    //Throttle: 第 L 级每 2^L 帧运行一次, dt 累加; Slice: 每帧运行, 但只处理 slice() 给出的 1/2^L 的实体
+    //两种方式到最高级都整帧跳过
+    enum class DegradeMode : std::uint8_t {
+        Throttle,
+        Slice
+    };
+
+    //把 count 个实体分成 parts 份, 本帧处理第 part 份 [begin(count), end(count))
+    struct SystemSlice {
+        std::size_t part = 0;
+        std::size_t parts = 1;
+
+        std::size_t begin(std::size_t count) const { return count * part / parts; }
+        std::size_t end(std::size_t count) const { return count * (part + 1) / parts; }
+    };
+
+    struct DegradeStats {
+        const char* system = nullptr;
+        int priority = 0;
+        unsigned level = 0;
+        std::uint64_t runs = 0;
+        std::uint64_t shed = 0;     //因降级没有运行的帧数
+    };
+
+    struct FrameBudgetStats {
+        double budget = 0;
+        double last_frame = 0;
+        double average = 0;         //帧耗时的指数移动平均, 降级和恢复都看它
+        std::uint64_t frames = 0;
+        std::uint64_t over_budget = 0;
+        std::uint64_t degrades = 0;
+        std::uint64_t recoveries = 0;
+    };
+
+    class BaseSystem : public entt::Family<struct SystemFamily> {
+    public:
+        typedef size_t Family;
+
+        virtual ~BaseSystem() {};
+
+        virtual void configure(EntityManager &entities, EventManager &events) {
+            configure(events);
+        }
+        virtual void configure(EventManager &events) {}
+        virtual void update(EntityManager &entities, EventManager &events, TimeDelta dt) = 0;
+
+        //SystemManager::update_parallel 时调用, 把本帧的工作作为任务提交到 graph
+        //默认提交一个调用 update 的任务, 排在前面所有系统之后, 和 update_all 的顺序一致
+        virtual void schedule(EntityManager &entities, EventManager &events, TimeDelta dt, TaskGraph &graph) {
+            graph.add([this, &entities, &events, dt] {
+                ENTTWRAP_ZONE(typeid(*this).name());
+                update(entities, events, dt);
+            }, { graph.previous() });
+        }
+
+        //---------------------------响应式--------------------------
+        //在 configure 里声明触发条件后成为响应式系统: update_all 只在上次运行以来有条件触发过时才调用 update
+        //组件条件见 EntityManager::watch_changes, 事件条件见 EventManager::watch_event; 第一次总会运行
+        template <typename ... Components>
+        void trigger_on_components(EntityManager &entities) {
+            using accumulator_type = int[];
+            accumulator_type accumulator = { 0, (component_triggers_.push_back(entities.watch_changes<Components>()), 0)... };
+            (void)accumulator;
+        }
+
+        template <typename ... Events>
+        void trigger_on_events(EventManager &events) {
+            using accumulator_type = int[];
+            accumulator_type accumulator = { 0, (event_triggers_.push_back(events.watch_event<Events>()), 0)... };
+            (void)accumulator;
+        }
+
+        bool reactive() const {
+            return !component_triggers_.empty() || !event_triggers_.empty();
+        }
+
+        //计数只增不减, 所以总和变了就说明至少一个条件触发过; 记下运行前的总和, 运行中触发的留到下一帧
+        bool triggered(const EntityManager &entities, const EventManager &events) {
+            std::uint64_t sum;
+            if (!pending_triggers_(entities, events, sum)) {
+                return false;
+            }
+            last_trigger_sum_ = sum;
+            return true;
+        }
+
+        //---------------------------降级--------------------------
+        //SystemManager 设置了帧预算时, 超预算先降 priority 小的系统, 恢复时先恢复 priority 大的
+        static constexpr unsigned max_degrade_level = 4;
+
+        void set_degradable(int priority, DegradeMode mode = DegradeMode::Throttle) {
+            degradable_ = true;
+            degrade_priority_ = priority;
+            degrade_mode_ = mode;
+        }
+
+        bool degradable() const {
+            return degradable_;
+        }
+
+        unsigned degrade_level() const {
+            return degrade_level_;
+        }
+
+        //Slice 模式下本帧要处理的部分, 没有降级时是整体
+        const SystemSlice& slice() const {
+            return slice_;
+        }
+
+    private:
+        friend class SystemManager;
+
+        std::vector<std::size_t> component_triggers_;
+        std::vector<std::size_t> event_triggers_;
+        std::uint64_t last_trigger_sum_ = ~std::uint64_t(0);
+
+        //只检查不记录; sum 是要记下的总和, 系统真正运行时才写进 last_trigger_sum_
+        bool pending_triggers_(const EntityManager &entities, const EventManager &events, std::uint64_t &sum) const {
+            sum = last_trigger_sum_;
+            if (!reactive()) {
+                return true;
+            }
+            sum = 0;
+            for (auto family : component_triggers_) {
+                sum += entities.change_version(family);
+            }
+            for (auto family : event_triggers_) {
+                sum += events.event_version(family);
+            }
+            return sum != last_trigger_sum_;
+        }
+
+        bool degradable_ = false;
+        int degrade_priority_ = 0;
+        DegradeMode degrade_mode_ = DegradeMode::Throttle;
+        unsigned degrade_level_ = 0;
+        unsigned degrade_phase_ = 0;
+        double degrade_saving_ = 0;
+        SystemSlice slice_;
+        TimeDelta shed_dt_ = 0;
+        DegradeStats degrade_stats_;
+    };
+
+    //PerEntity: 对每个实体依次执行所有 kernel; PerChunk: 每 chunk_size 个实体为一段, 一个 kernel 处理完整段再换下一个
+    //两种方式下同一个实体都先经过前面的 kernel; 区别只在 kernel 读别的实体时看到的是否已被后面的实体更新
+    enum class FusionMode : std::uint8_t {
+        PerEntity,
+        PerChunk
+    };
+
+    //查询相同的若干个系统改写成 kernel, 加进同一个 FusedSystem, 每帧只遍历一次视图
+    //begin 每帧在遍历前调用一次; kernel 里不能增删实体或这些组件
+    template <typename ... Components>
+    class FusedKernel {
+    public:
+        virtual ~FusedKernel() = default;
+
+        virtual void configure(EntityManager &entities, EventManager &events) {}
+        virtual void begin(EntityManager &entities, EventManager &events, TimeDelta dt) {}
+        virtual void apply(entity_type entity, Components & ... components) = 0;
+
+        //PerChunk 时调用, 默认逐个 apply; 可以重写成整段处理
+        virtual void apply_chunk(std::size_t count, const entity_type* entities, Components* const* ... components) {
+            for (std::size_t i = 0; i < count; ++i) {
+                apply(entities[i], *components[i]...);
+            }
+        }
+    };
+
+    template <typename ... Components>
+    class FusedSystem : public BaseSystem {
+    public:
+        static constexpr std::size_t chunk_size = 64;
+
+        explicit FusedSystem(FusionMode mode = FusionMode::PerChunk) : mode_(mode) {}
+
+        //kernel 按加入的顺序执行
+        template <typename Kernel, typename ... Args>
+        std::shared_ptr<Kernel> add(Args && ... args) {
+            std::shared_ptr<Kernel> kernel(new Kernel(std::forward<Args>(args) ...));
+            kernels_.push_back(kernel);
+            return kernel;
+        }
+
+        void configure(EntityManager &entities, EventManager &events) override {
+            for (auto &kernel : kernels_) {
+                kernel->configure(entities, events);
+            }
+        }
+
+        void update(EntityManager &entities, EventManager &events, TimeDelta dt) override {
+            for (auto &kernel : kernels_) {
+                kernel->begin(entities, events, dt);
+            }
+            entities.thaw_all<Components...>();
+            auto view = entities.view<Components...>();
+            if (mode_ == FusionMode::PerEntity) {
+                for (auto entity : view) {
+                    apply_(entity, entities.get<Components>(entity)...);
+                }
+                return;
+            }
+            std::size_t count = 0;
+            for (auto entity : view) {
+                chunk_entities_[count] = entity;
+                gather_(count, entity, entities, std::index_sequence_for<Components...>{});
+                if (++count == chunk_size) {
+                    flush_(count, std::index_sequence_for<Components...>{});
+                    count = 0;
+                }
+            }
+            if (count) {
+                flush_(count, std::index_sequence_for<Components...>{});
+            }
+        }
+
+    private:
+        void apply_(entity_type entity, Components & ... components) {
+            for (auto &kernel : kernels_) {
+                kernel->apply(entity, components...);
+            }
+        }
+
+        template <std::size_t ... I>
+        void gather_(std::size_t slot, entity_type entity, EntityManager &entities, std::index_sequence<I...>) {
+            using accumulator_type = int[];
+            accumulator_type accumulator = { 0, (std::get<I>(chunk_components_)[slot] = &entities.get<Components>(entity), 0)... };
+            (void)accumulator;
+        }
+
+        template <std::size_t ... I>
+        void flush_(std::size_t count, std::index_sequence<I...>) {
+            for (auto &kernel : kernels_) {
+                kernel->apply_chunk(count, chunk_entities_, std::get<I>(chunk_components_)...);
+            }
+        }
+
+        FusionMode mode_;
+        std::vector<std::shared_ptr<FusedKernel<Components...>>> kernels_;
+        entity_type chunk_entities_[chunk_size];
+        std::tuple<Components* [chunk_size]...> chunk_components_;
+    };
+
+    class SystemManager {
+    public:
+        SystemManager(EntityManager &entity_manager,
+            EventManager &event_manager) :
+            entity_manager_(entity_manager),
+            event_manager_(event_manager) {}
+
+        template <typename System>
+        void add(std::shared_ptr<System> system) {
+            systems_.insert(std::make_pair(System::type<System>(), system));
+        }
+
+        template <typename System, typename ... Args>
+        std::shared_ptr<System> add(Args && ... args) {
+            std::shared_ptr<System> s(new System(std::forward<Args>(args) ...));
+            add(s);
+            return s;
+        }
+
+        //查询为 Components... 的融合系统, 第一次调用时创建并加入; 要在 configure 之前加好 kernel
+        template <typename ... Components>
+        std::shared_ptr<FusedSystem<Components...>> fuse(FusionMode mode = FusionMode::PerChunk) {
+            using System = FusedSystem<Components...>;
+            auto it = systems_.find(System::template type<System>());
+            if (it != systems_.end()) {
+                return std::static_pointer_cast<System>(it->second);
+            }
+            return add<System>(mode);
+        }
+
+        template <typename System>
+        std::shared_ptr<System> system() {
+            auto it = systems_.find(System::type<System>());
+            assert(it != systems_.end());
             return it == systems_.end()
                 ? std::shared_ptr<System>()
                 : std::shared_ptr<System>(std::static_pointer_cast<System>(it->second));
@@ -511,15 +4206,92 @@ namespace entt {
         void update(TimeDelta dt) {
             assert(initialized_ && "SystemManager::configure() not called");
             std::shared_ptr<System> s = system<System>();
+            ENTTWRAP_ZONE(typeid(System).name());
             s->update(entity_manager_, event_manager_, dt);
         }
 
         void update_all(TimeDelta dt) {
             assert(initialized_ && "SystemManager::configure() not called");
+            auto start = std::chrono::steady_clock::now();
             for (auto &pair : systems_) {
-                pair.second->update(entity_manager_, event_manager_, dt);
+                TimeDelta system_dt = dt;
+                if (!runnable_(*pair.second, system_dt)) {
+                    continue;
+                }
+                ENTTWRAP_ZONE(typeid(*pair.second).name());
+                pair.second->update(entity_manager_, event_manager_, system_dt);
+            }
+            entity_manager_.swap_buffers();
+            entity_manager_.flush_lifecycle();
+            if (budget_.budget > 0) {
+                rebalance_(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
             }
         };
+
+        //---------------------------帧预算--------------------------
+        //seconds 为 update_all/update_parallel 每帧的预算, 0 关闭; 按帧耗时的移动平均判断, 不看单帧
+        //平均超出预算或窗口内一半的帧超出时把一个可降级系统降一级; 估计恢复后仍低于 recover_ratio 倍预算时恢复一级
+        //两次调整至少隔 settle_frames 帧, 等平均值反映出上次调整的效果
+        //同一级的系统各有相位, 隔帧运行时错开, 不会挤在同一帧
+        static constexpr double recover_ratio = 0.75;
+        static constexpr double average_weight = 0.2;
+        static constexpr std::uint64_t settle_frames = 8;
+
+        void set_frame_budget(double seconds) {
+            budget_.budget = seconds;
+            if (seconds <= 0) {
+                for (auto &pair : systems_) {
+                    pair.second->degrade_level_ = 0;
+                    pair.second->slice_ = SystemSlice();
+                }
+            }
+        }
+
+        const FrameBudgetStats& frame_budget_stats() const {
+            return budget_;
+        }
+
+        std::vector<DegradeStats> degrade_stats() const {
+            std::vector<DegradeStats> stats;
+            for (auto &pair : systems_) {
+                if (pair.second->degradable_) {
+                    stats.push_back(pair.second->degrade_stats_);
+                    stats.back().system = typeid(*pair.second).name();
+                    stats.back().priority = pair.second->degrade_priority_;
+                    stats.back().level = pair.second->degrade_level_;
+                }
+            }
+            return stats;
+        }
+
+        //和 update_all 相同(包括响应式跳过和帧预算), 但各系统通过 schedule 提交任务图, 不同系统的任务可以在 WorkerPool 上交错执行
+        void update_parallel(TimeDelta dt) {
+            assert(initialized_ && "SystemManager::configure() not called");
+            if (!workers_) {
+                workers_.reset(new WorkerPool());
+            }
+            auto start = std::chrono::steady_clock::now();
+            graph_.clear();
+            for (auto &pair : systems_) {
+                graph_.begin_system_();
+                TimeDelta system_dt = dt;
+                if (runnable_(*pair.second, system_dt)) {
+                    pair.second->schedule(entity_manager_, event_manager_, system_dt, graph_);
+                }
+                graph_.end_system_(pair.first);
+            }
+            graph_.run(*workers_);
+            entity_manager_.swap_buffers();
+            entity_manager_.flush_lifecycle();
+            if (budget_.budget > 0) {
+                rebalance_(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+            }
+        }
+
+        void set_worker_threads(std::size_t threads) {
+            workers_.reset(new WorkerPool(threads));
+        }
+
         void configure() {
             for (auto &pair : systems_) {
                 pair.second->configure(entity_manager_, event_manager_);
@@ -532,8 +4304,172 @@ namespace entt {
         EntityManager &entity_manager_;
         EventManager &event_manager_;
         std::unordered_map<BaseSystem::Family, std::shared_ptr<BaseSystem>> systems_;
+        std::unique_ptr<WorkerPool> workers_;
+        TaskGraph graph_;
+
+        //触发条件满足且帧预算允许时返回 true 并记下触发; 被降级跳过的帧不记录触发, 条件留到下一次真正运行
+        bool runnable_(BaseSystem &system, TimeDelta &dt) {
+            std::uint64_t trigger_sum;
+            if (!system.pending_triggers_(entity_manager_, event_manager_, trigger_sum)) {
+                return false;
+            }
+            if (budget_.budget > 0 && system.degradable_ && !admit_(system, dt)) {
+                return false;
+            }
+            system.last_trigger_sum_ = trigger_sum;
+            return true;
+        }
+
+        //决定降级系统本帧是否运行, 运行时 dt 带上跳过的帧累计的时间
+        bool admit_(BaseSystem &system, TimeDelta &dt) {
+            auto level = system.degrade_level_;
+            std::size_t period = std::size_t(1) << level;
+            auto phase = std::size_t((budget_.frames + system.degrade_phase_) % period);
+            bool run = level < BaseSystem::max_degrade_level
+                && (system.degrade_mode_ == DegradeMode::Slice || phase == 0);
+            if (!run) {
+                system.shed_dt_ += dt;
+                ++system.degrade_stats_.shed;
+                return false;
+            }
+            system.slice_ = system.degrade_mode_ == DegradeMode::Slice
+                ? SystemSlice{ phase, period }
+                : SystemSlice();
+            dt += system.shed_dt_;
+            system.shed_dt_ = 0;
+            ++system.degrade_stats_.runs;
+            return true;
+        }
+
+        void rebalance_(double seconds) {
+            budget_.last_frame = seconds;
+            budget_.average = budget_.frames ? budget_.average + (seconds - budget_.average) * average_weight : seconds;
+            ++budget_.frames;
+            if (seconds > budget_.budget) {
+                ++budget_.over_budget;
+                ++window_over_;
+            }
+            if (budget_.frames < last_adjust_ + settle_frames) {
+                return;
+            }
+            //上次降级后平均值的降幅就是该系统省下的时间, 恢复前用它估计恢复后的帧耗时
+            if (last_degraded_) {
+                last_degraded_->degrade_saving_ = std::max(0.0, adjust_average_ - budget_.average);
+                last_degraded_ = nullptr;
+            }
+            //优先级相同时先降级别低的(恢复时先恢复级别高的), 负载分摊到几个系统上, 错开后峰值更低
+            BaseSystem* target = nullptr;
+            //平均超出预算, 或者一半以上的帧超出(隔帧的峰值), 都要降级
+            if (budget_.average > budget_.budget || window_over_ * 2 >= settle_frames) {
+                for (auto &pair : systems_) {
+                    auto &system = *pair.second;
+                    if (system.degradable_ && system.degrade_level_ < BaseSystem::max_degrade_level
+                        && (!target || system.degrade_priority_ < target->degrade_priority_
+                            || (system.degrade_priority_ == target->degrade_priority_ && system.degrade_level_ < target->degrade_level_))) {
+                        target = &system;
+                    }
+                }
+                if (target) {
+                    //按降级的先后给相位, 同一级的系统错开运行
+                    target->degrade_phase_ = unsigned(budget_.degrades);
+                    ++target->degrade_level_;
+                    ++budget_.degrades;
+                    last_degraded_ = target;
+                    adjust_average_ = budget_.average;
+                }
+            } else {
+                for (auto &pair : systems_) {
+                    auto &system = *pair.second;
+                    if (system.degrade_level_ > 0 && (!target || system.degrade_priority_ > target->degrade_priority_
+                        || (system.degrade_priority_ == target->degrade_priority_ && system.degrade_level_ > target->degrade_level_))) {
+                        target = &system;
+                    }
+                }
+                if (target && budget_.average + target->degrade_saving_ < budget_.budget * recover_ratio) {
+                    --target->degrade_level_;
+                    ++budget_.recoveries;
+                    if (target->degrade_level_ == 0) {
+                        target->slice_ = SystemSlice();
+                    }
+                } else {
+                    target = nullptr;
+                }
+            }
+            if (target) {
+                last_adjust_ = budget_.frames;
+            }
+            window_over_ = 0;
+        }
+
+        FrameBudgetStats budget_;
+        std::uint64_t last_adjust_ = 0;
+        std::uint64_t window_over_ = 0;
+        BaseSystem* last_degraded_ = nullptr;
+        double adjust_average_ = 0;
     };
 
+    //系统集合在编译期确定时使用: 系统按值放在 tuple 里, 用限定名调用 update/configure, 编译器可以内联
+    //configure/update_all 支持响应式跳过、swap_buffers 和 flush_lifecycle, 执行顺序是模板参数的顺序
+    //不支持 SystemManager 的帧预算和降级(set_degradable 不起作用), 也没有 update_parallel
+    template <typename ... Systems>
+    class StaticSystemManager {
+    public:
+        StaticSystemManager(EntityManager &entity_manager,
+            EventManager &event_manager) :
+            entity_manager_(entity_manager),
+            event_manager_(event_manager) {}
+
+        template <typename System>
+        System& system() {
+            return std::get<System>(systems_);
+        }
+
+        template <typename System>
+        void update(TimeDelta dt) {
+            assert(initialized_ && "StaticSystemManager::configure() not called");
+            update_(std::get<System>(systems_), dt);
+        }
+
+        void update_all(TimeDelta dt) {
+            assert(initialized_ && "StaticSystemManager::configure() not called");
+            update_all_(dt, std::index_sequence_for<Systems...>{});
+            entity_manager_.swap_buffers();
+            entity_manager_.flush_lifecycle();
+        }
+
+        void configure() {
+            configure_(std::index_sequence_for<Systems...>{});
+            initialized_ = true;
+        }
+
+    private:
+        template <typename System>
+        void update_(System &system, TimeDelta dt) {
+            ENTTWRAP_ZONE(typeid(System).name());
+            system.System::update(entity_manager_, event_manager_, dt);
+        }
+
+        template <std::size_t ... I>
+        void update_all_(TimeDelta dt, std::index_sequence<I...>) {
+            using accumulator_type = int[];
+            accumulator_type accumulator = { 0, (std::get<I>(systems_).triggered(entity_manager_, event_manager_) ? update_(std::get<I>(systems_), dt) : void(), 0)... };
+            (void)accumulator;
+        }
+
+        template <std::size_t ... I>
+        void configure_(std::index_sequence<I...>) {
+            using accumulator_type = int[];
+            //configure 只调用一次, 经过基类调用以免被子类的同名重载隐藏
+            accumulator_type accumulator = { 0, (static_cast<BaseSystem&>(std::get<I>(systems_)).configure(entity_manager_, event_manager_), 0)... };
+            (void)accumulator;
+        }
+
+        bool initialized_ = false;
+        EntityManager &entity_manager_;
+        EventManager &event_manager_;
+        std::tuple<Systems...> systems_;
+    };
+
 
     template <typename Component>
     ComponentHandle<Component> Entity::component() const
@@ -544,7 +4480,7 @@ namespace entt {
     template <typename Component>
     Component& Entity::componentRaw() const
     {
-        return manager_->get<Component>(id_);
+        return manager_->fetch<Component>(id_);
     }
 
 
@@ -552,7 +4488,7 @@ namespace entt {
     bool Entity::has_component() const
     {
         if (id_ != INVALID) {
-            return manager_->has<Component>(id_);
+            return manager_->contains<Component>(id_);
         }
         return false;
     }
@@ -572,6 +4508,7 @@ namespace entt {
     {
         if (id_ != INVALID)
         {
+            manager_->thaw<Component>(id_);
             manager_->remove<Component>(id_);
         }
     }
@@ -605,48 +4542,49 @@ namespace entt {
 
     template <typename C>
     inline bool ComponentHandle<C>::valid() const {
-        return manager_ && manager_->valid(id_) && manager_->has<C>(id_);
+        return manager_ && manager_->valid(id_) && manager_->contains<C>(id_);
     }
 
     template <typename C>
     inline C *ComponentHandle<C>::operator -> () {
         assert(valid());
-        return &manager_->get<C>(id_);
+        return &manager_->fetch<C>(id_);
     }
 
     template <typename C>
     inline const C *ComponentHandle<C>::operator -> () const {
         assert(valid());
-        return &manager_->get<C>(id_);
+        return &manager_->fetch<C>(id_);
     }
 
     template <typename C>
     inline C &ComponentHandle<C>::operator * () {
         assert(valid());
-        return manager_->get<C>(id_);
+        return manager_->fetch<C>(id_);
     }
 
     template <typename C>
     inline const C &ComponentHandle<C>::operator * () const {
         assert(valid());
-        return manager_->get<C>(id_);
+        return manager_->fetch<C>(id_);
     }
 
     template <typename C>
     inline C *ComponentHandle<C>::get() {
         assert(valid());
-        return &manager_->get<C>(id_);
+        return &manager_->fetch<C>(id_);
     }
 
     template <typename C>
     inline const C *ComponentHandle<C>::get() const {
         assert(valid());
-        return &manager_->get<C>(id_);
+        return &manager_->fetch<C>(id_);
     }
 
     template <typename C>
     inline void ComponentHandle<C>::remove() {
         assert(valid());
+        manager_->thaw<C>(id_);
         manager_->remove<C>(id_);
     }
 
@@ -0,0 +1,126 @@
+//视图预取的对比测试: 同一个视图分别关闭预取和打开不同预取距离遍历, 输出每个实体的耗时和缓存未命中数
+//Velocity 池按随机键排序, 遍历时按 Position 的顺序随机访问它, 稀疏数组和组件都会频繁未命中
+//预取的是视图之后解引用的组件地址(经 EnTT 自己的稀疏数组取得), 没有额外维护的表, 测到的就是全部开销
+//编译: g++ -O2 -std=c++14 -I<entt 所在目录> -I.. view_prefetch.cpp -o view_prefetch
+//Linux 下用 perf_event_open 统计未命中; 其它平台只输出耗时, 可以配合 perf stat -e cache-misses 使用
+#include "EnttWrap.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <random>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#endif
+
+struct Position {
+    float x, y, z;
+    float padding[13];
+};
+
+struct Velocity {
+    float x, y, z;
+    std::uint32_t shuffle;
+    float padding[12];
+};
+
+//打开失败时 read 返回 -1, 只输出耗时
+class MissCounter {
+public:
+    MissCounter() {
+#if defined(__linux__)
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd_ = int(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+    }
+    ~MissCounter() {
+#if defined(__linux__)
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+#endif
+    }
+    void start() {
+#if defined(__linux__)
+        if (fd_ >= 0) {
+            ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+    long long stop() {
+        long long count = -1;
+#if defined(__linux__)
+        if (fd_ >= 0) {
+            ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fd_, &count, sizeof(count)) != sizeof(count)) {
+                count = -1;
+            }
+        }
+#endif
+        return count;
+    }
+private:
+    int fd_ = -1;
+};
+
+int main(int argc, char** argv) {
+    std::size_t count = argc > 1 ? std::size_t(std::atoll(argv[1])) : (std::size_t(1) << 20);
+    const int rounds = 5;
+
+    entt::EntityX world;
+    entt::EntityManager& entities = world.entities;
+    std::mt19937 random(12345);
+    for (std::size_t i = 0; i < count; ++i) {
+        entt::Entity entity = entities.createEntity();
+        entity.assign<Position>(Position{ float(i), 0.0f, 0.0f });
+        entity.assign<Velocity>(Velocity{ 1.0f, 2.0f, 3.0f, std::uint32_t(random()) });
+    }
+    entities.sort<Velocity>([](const Velocity& lhs, const Velocity& rhs) {
+        return lhs.shuffle < rhs.shuffle;
+    });
+
+    MissCounter misses;
+    const std::size_t distances[] = { 0, 4, 8, 16, 32 };
+    std::printf("%10s %14s %16s\n", "distance", "ns/entity", "misses/entity");
+    for (std::size_t distance : distances) {
+        double best = 0.0;
+        long long best_misses = -1;
+        for (int round = 0; round < rounds; ++round) {
+            entt::ComponentHandle<Position> position;
+            entt::ComponentHandle<Velocity> velocity;
+            misses.start();
+            auto begin = std::chrono::steady_clock::now();
+            for (auto entity : entities.entities_with_components(position, velocity).prefetch(distance)) {
+                position->x += velocity->x;
+                position->y += velocity->y;
+                position->z += velocity->z;
+            }
+            auto end = std::chrono::steady_clock::now();
+            long long miss_count = misses.stop();
+            double elapsed = std::chrono::duration<double, std::nano>(end - begin).count() / double(count);
+            if (round == 0 || elapsed < best) {
+                best = elapsed;
+                best_misses = miss_count;
+            }
+        }
+        if (best_misses >= 0) {
+            std::printf("%10zu %14.2f %16.3f\n", distance, best, double(best_misses) / double(count));
+        } else {
+            std::printf("%10zu %14.2f %16s\n", distance, best, "n/a");
+        }
+    }
+    return 0;
+}